@@ -30,7 +30,7 @@ public:
 template <typename T>
 void bench(uint64_t n) {
     T t;
-    elapsed e(get_filt_type_name<T>());
+    elapsed e(std::string(type_name<T>()));
     t.impl(n);
 }
 
@@ -1,4 +1,12 @@
 #include "util.h"
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string_view>
+#include <sys/mman.h>
 
 using std::make_pair;
 using std::make_shared;
@@ -7,6 +15,7 @@ using std::make_unique;
 using std::map;
 using std::shared_ptr;
 using std::string;
+using std::string_view;
 using std::tuple;
 using std::unique_ptr;
 using std::unordered_map;
@@ -16,10 +25,31 @@ typedef struct {
     size_t capacity;
     int interval;
     int is_v2;
+    int range;
     int enable_fifo;
     int enable_lru;
     int enable_block;
     int enable_block_v2;
+    int enable_tinylfu;
+    int enable_arc;
+    int enable_s3fifo;
+    int enable_lirs;
+    int enable_range_lru;
+    int enable_log;
+    int admission;
+    size_t block_size;
+    char *log_gc;
+    int bench;
+    int pipeline;
+    char *trace;
+    int parse_threads;
+    char *convert;
+    double sample_rate;
+    char *mrc;
+    int bench_blocks;
+    char *clock;
+    char *save_state;
+    char *load_state;
 } config;
 
 static config g_cfg;
@@ -31,71 +61,330 @@ public:
         long count;
         long used;
         long capacity;
+        long hit_count;
+        long miss_count;
+        long hit_length;
+        long miss_length;
     };
 
     virtual ~CacheStat() = default;
-    virtual void on_get(const string &key, const size_t length, bool is_hit) = 0;
+    virtual void on_get(uint64_t key, const size_t length, bool is_hit) = 0;
     virtual Stat get_stat() const = 0;
+    virtual void log_summary() const = 0;
+};
+
+// Cache state files: a header, then one section per cache holding its class name and
+// whatever its policy writes. Policies write plain records, oldest first, and restore
+// by replaying them through their own insert path, so a state loads into any capacity.
+static const char kStateMagic[8] = { 'C', 'S', 'S', 'T', 'A', 'T', 'E', '1' };
+static const uint32_t kStateVersion = 1;
+
+struct StateFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    // requests replayed before the save, the tick clock goes on from there
+    uint64_t ticks;
+};
+
+struct StateSectionHeader {
+    uint32_t name_length;
+    uint32_t reserved;
+    uint64_t payload_size;
+};
+
+class StateWriter {
+public:
+    explicit StateWriter(FILE *fp)
+        : fp_(fp)
+    {
+    }
+
+    template <typename T> void put(const T &v)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "records are raw bytes");
+        write(&v, sizeof(v));
+    }
+
+    void write(const void *data, size_t n)
+    {
+        if (fwrite(data, 1, n, fp_) != n) {
+            log_fatal("write state failed: %s", strerror(errno));
+        }
+        bytes_ += n;
+    }
+
+    size_t bytes() const { return bytes_; }
+
+private:
+    FILE *fp_;
+    size_t bytes_ = 0;
+};
+
+class StateReader {
+public:
+    StateReader(const char *data, size_t size)
+        : p_(data)
+        , end_(data + size)
+    {
+    }
+
+    template <typename T> T get()
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "records are raw bytes");
+        T v;
+        memcpy(&v, read(sizeof(v)), sizeof(v));
+        return v;
+    }
+
+    const char *read(size_t n)
+    {
+        if ((size_t)(end_ - p_) < n) {
+            log_fatal("state file is truncated");
+        }
+        const char *p = p_;
+        p_ += n;
+        return p;
+    }
+
+    bool done() const { return p_ == end_; }
+
+private:
+    const char *p_;
+    const char *end_;
 };
 
 class Cache {
 public:
     virtual ~Cache() = default;
-    virtual void get(const string &key, const size_t length) = 0;
+    // now is the logical time of the request, see --clock
+    virtual void get(uint64_t key, const size_t length, uint64_t now) = 0;
+    // parts first..last of an object, see --range. Unless the policy models ranges, each
+    // part is a get of its own part key.
+    virtual void get_range(
+        uint64_t object_key, size_t entity_length, uint32_t first, uint32_t last, uint64_t now);
+    // false when the policy cannot save its state
+    virtual bool save_state(StateWriter &) const { return false; }
+    virtual bool load_state(StateReader &) { return false; }
 };
 
-template <typename Key> class FIFOCacheImpl {
+static const uint32_t kNilNode = UINT32_MAX;
+
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Slab of cache nodes addressed by 32-bit index, with an embedded open-addressing
+// index from key to node. Links between nodes are indices, freed nodes go to a free
+// list and are reused, so once the cache is full set/evict never touch the allocator.
+// A list is a sentinel node allocated from the same slab; an empty list points to itself.
+// Policies that keep per-node state put it in Meta, an empty Meta costs nothing.
+struct NoMeta { };
+
+template <typename Key, typename Meta = NoMeta> class NodeTable {
 public:
-    struct CacheImpl {
-        CacheImpl() = default;
-        CacheImpl(Key key, size_t length)
-            : key(key)
-            , length(length)
-        {
-        }
+    struct Node : Meta {
         Key key;
         size_t length;
-        CacheImpl *prev;
-        CacheImpl *next;
+        uint32_t prev;
+        uint32_t next;
+    };
+
+    NodeTable() { rehash(16); }
+
+    Node &operator[](uint32_t n) { return nodes_[n]; }
+
+    const Node &operator[](uint32_t n) const { return nodes_[n]; }
+
+    size_t size() const { return count_; }
+
+    uint32_t find(const Key &key) const
+    {
+        uint64_t h = hash_key(key);
+        for (size_t i = h & mask_;; i = (i + 1) & mask_) {
+            const Slot &s = slots_[i];
+            if (s.node == kNilNode) {
+                return kNilNode;
+            }
+            if (s.tag == (uint32_t)h && nodes_[s.node].key == key) {
+                return s.node;
+            }
+        }
+    }
+
+    // makes room for n more keys, so inserting them never rehashes
+    void reserve(size_t n)
+    {
+        nodes_.reserve(nodes_.size() + n);
+        size_t nslots = slots_.size();
+        while ((count_ + n) * 4 > nslots * 3) {
+            nslots *= 2;
+        }
+        if (nslots != slots_.size()) {
+            rehash(nslots);
+        }
+    }
+
+    // the key must not be present, references to nodes are invalidated
+    uint32_t insert(const Key &key, size_t length)
+    {
+        if ((count_ + 1) * 4 > slots_.size() * 3) {
+            rehash(slots_.size() * 2);
+        }
+
+        uint32_t n = alloc_node();
+        static_cast<Meta &>(nodes_[n]) = Meta {};
+        nodes_[n].key = key;
+        nodes_[n].length = length;
+        place(n, hash_key(key));
+        count_++;
+        return n;
+    }
+
+    void erase(uint32_t n)
+    {
+        size_t i = hash_key(nodes_[n].key) & mask_;
+        while (slots_[i].node != n) {
+            i = (i + 1) & mask_;
+        }
+
+        // backward shift deletion keeps probe chains intact without tombstones
+        for (size_t j = (i + 1) & mask_; slots_[j].node != kNilNode; j = (j + 1) & mask_) {
+            size_t home = slots_[j].tag & mask_;
+            if (((j - home) & mask_) >= ((j - i) & mask_)) {
+                slots_[i] = slots_[j];
+                i = j;
+            }
+        }
+        slots_[i].node = kNilNode;
+
+        free_node(n);
+        count_--;
+    }
+
+    uint32_t new_list()
+    {
+        uint32_t n = alloc_node();
+        nodes_[n].prev = n;
+        nodes_[n].next = n;
+        return n;
+    }
+
+    void push_front(uint32_t list, uint32_t n)
+    {
+        Node &c = nodes_[n];
+        c.next = nodes_[list].next;
+        c.prev = list;
+        nodes_[c.next].prev = n;
+        nodes_[list].next = n;
+    }
+
+    void unlink(uint32_t n)
+    {
+        Node &c = nodes_[n];
+        nodes_[c.prev].next = c.next;
+        nodes_[c.next].prev = c.prev;
+    }
+
+    // returns the list itself when it is empty
+    uint32_t back(uint32_t list) const { return nodes_[list].prev; }
+
+private:
+    struct Slot {
+        uint32_t node;
+        uint32_t tag;
     };
 
+    static uint64_t hash_key(const Key &key) { return mix64(std::hash<Key>()(key)); }
+
+    uint32_t alloc_node()
+    {
+        if (free_ != kNilNode) {
+            uint32_t n = free_;
+            free_ = nodes_[n].next;
+            return n;
+        }
+        nodes_.emplace_back();
+        return nodes_.size() - 1;
+    }
+
+    void free_node(uint32_t n)
+    {
+        nodes_[n].next = free_;
+        free_ = n;
+    }
+
+    void place(uint32_t n, uint64_t h)
+    {
+        size_t i = h & mask_;
+        while (slots_[i].node != kNilNode) {
+            i = (i + 1) & mask_;
+        }
+        slots_[i].node = n;
+        slots_[i].tag = (uint32_t)h;
+    }
+
+    void rehash(size_t nslots)
+    {
+        vector<Slot> old(nslots, Slot { kNilNode, 0 });
+        old.swap(slots_);
+        mask_ = nslots - 1;
+        for (const Slot &s : old) {
+            if (s.node != kNilNode) {
+                // the tag holds the low 32 bits of the hash, enough to find the home slot
+                place(s.node, s.tag);
+            }
+        }
+    }
+
+private:
+    vector<Node> nodes_;
+    vector<Slot> slots_;
+    uint32_t free_ = kNilNode;
+    size_t mask_ = 0;
+    size_t count_ = 0;
+};
+
+template <typename Key> class FIFOCacheImpl {
+public:
     FIFOCacheImpl(size_t capacity)
     {
         capacity_ = capacity;
         size_ = 0;
-        head_.next = &tail_;
-        tail_.prev = &head_;
+        list_ = nodes_.new_list();
     }
 
-    tuple<bool, size_t> get(Key key)
+    tuple<bool, size_t> get(const Key &key)
     {
-        auto it = vmap_.find(key);
-        if (it == vmap_.end()) {
+        uint32_t n = nodes_.find(key);
+        if (n == kNilNode) {
             return make_tuple(false, 0);
         } else {
-            CacheImpl *c = it->second;
-            return make_tuple(true, c->length);
+            return make_tuple(true, nodes_[n].length);
         }
     }
 
-    void set(Key key, size_t length)
+    void set(const Key &key, size_t length)
     {
-        auto it = vmap_.find(key);
-        if (it != vmap_.end()) {
-            CacheImpl *c = it->second;
-            size_ -= c->length;
-            c->length = length;
-            size_ += c->length;
+        uint32_t n = nodes_.find(key);
+        if (n != kNilNode) {
+            size_ -= nodes_[n].length;
+            nodes_[n].length = length;
+            size_ += length;
         } else {
-            CacheImpl *c = new CacheImpl(key, length);
-            cache_push(c);
-            vmap_[key] = c;
+            n = nodes_.insert(key, length);
+            cache_push(n);
         }
 
         while (capacity_ < size_) {
-            CacheImpl *c = remove_last_cache();
-            vmap_.erase(c->key);
-            delete c;
+            n = remove_last_cache();
+            nodes_.erase(n);
         }
     }
 
@@ -103,106 +392,92 @@ public:
 
     const long used() const { return size_; }
 
-    const long count() const { return vmap_.size(); }
+    const long count() const { return nodes_.size(); }
 
-private:
-    void cache_push(CacheImpl *c)
+    // objects from the oldest to the newest, restored through set()
+    void save(StateWriter &w) const
     {
-        c->next = head_.next;
-        head_.next = c;
-        c->next->prev = c;
-        c->prev = &head_;
-        size_ += c->length;
+        w.put<uint64_t>(nodes_.size());
+        for (uint32_t n = nodes_.back(list_); n != list_; n = nodes_[n].prev) {
+            w.put(nodes_[n].key);
+            w.put<uint64_t>(nodes_[n].length);
+        }
     }
 
-    void cache_push(Key key, size_t length)
+    void load(StateReader &r)
     {
-        CacheImpl *c = new CacheImpl(key, length);
-        cache_push(c);
+        uint64_t count = r.get<uint64_t>();
+        nodes_.reserve(count);
+        for (uint64_t i = 0; i < count; i++) {
+            Key key = r.get<Key>();
+            size_t length = r.get<uint64_t>();
+            set(key, length);
+        }
     }
 
-    void move_cache_to_head(CacheImpl *c)
+private:
+    void cache_push(uint32_t n)
     {
-        cache_remove(c);
-        cache_push(c);
+        nodes_.push_front(list_, n);
+        size_ += nodes_[n].length;
     }
 
-    void cache_remove(CacheImpl *c)
+    void cache_remove(uint32_t n)
     {
-        c->prev->next = c->next;
-        c->next->prev = c->prev;
-        size_ -= c->length;
+        nodes_.unlink(n);
+        size_ -= nodes_[n].length;
     }
 
-    CacheImpl *remove_last_cache()
+    uint32_t remove_last_cache()
     {
-        CacheImpl *c = tail_.prev;
-        cache_remove(c);
-        return c;
+        uint32_t n = nodes_.back(list_);
+        cache_remove(n);
+        return n;
     }
 
 private:
-    CacheImpl head_;
-    CacheImpl tail_;
+    uint32_t list_;
     size_t capacity_;
     size_t size_;
-    unordered_map<Key, CacheImpl *> vmap_;
+    NodeTable<Key> nodes_;
 };
 
 template <typename Key> class LRUCacheImpl {
 public:
-    struct CacheImpl {
-        CacheImpl() = default;
-        CacheImpl(Key key, size_t length)
-            : key(key)
-            , length(length)
-        {
-        }
-        Key key;
-        size_t length;
-        CacheImpl *prev;
-        CacheImpl *next;
-    };
-
     LRUCacheImpl(size_t capacity)
     {
         capacity_ = capacity;
         size_ = 0;
-        head_.next = &tail_;
-        tail_.prev = &head_;
+        list_ = nodes_.new_list();
     }
 
-    tuple<bool, size_t> get(Key key)
+    tuple<bool, size_t> get(const Key &key)
     {
-        auto it = vmap_.find(key);
-        if (it == vmap_.end()) {
+        uint32_t n = nodes_.find(key);
+        if (n == kNilNode) {
             return make_tuple(false, 0);
         } else {
-            CacheImpl *c = it->second;
-            move_cache_to_head(c);
-            return make_tuple(true, c->length);
+            move_cache_to_head(n);
+            return make_tuple(true, nodes_[n].length);
         }
     }
 
-    void set(Key key, size_t length)
+    void set(const Key &key, size_t length)
     {
-        auto it = vmap_.find(key);
-        if (it != vmap_.end()) {
-            CacheImpl *c = it->second;
-            size_ -= c->length;
-            c->length = length;
-            size_ += c->length;
-            move_cache_to_head(c);
+        uint32_t n = nodes_.find(key);
+        if (n != kNilNode) {
+            size_ -= nodes_[n].length;
+            nodes_[n].length = length;
+            size_ += length;
+            move_cache_to_head(n);
         } else {
-            CacheImpl *c = new CacheImpl(key, length);
-            cache_push(c);
-            vmap_[key] = c;
+            n = nodes_.insert(key, length);
+            cache_push(n);
         }
 
         while (capacity_ < size_) {
-            CacheImpl *c = remove_last_cache();
-            vmap_.erase(c->key);
-            delete c;
+            n = remove_last_cache();
+            nodes_.erase(n);
         }
     }
 
@@ -210,50 +485,60 @@ public:
 
     const long used() const { return size_; }
 
-    const long count() const { return vmap_.size(); }
+    const long count() const { return nodes_.size(); }
 
-private:
-    void cache_push(CacheImpl *c)
+    // objects from the oldest to the newest, restored through set()
+    void save(StateWriter &w) const
     {
-        c->next = head_.next;
-        head_.next = c;
-        c->next->prev = c;
-        c->prev = &head_;
-        size_ += c->length;
+        w.put<uint64_t>(nodes_.size());
+        for (uint32_t n = nodes_.back(list_); n != list_; n = nodes_[n].prev) {
+            w.put(nodes_[n].key);
+            w.put<uint64_t>(nodes_[n].length);
+        }
     }
 
-    void cache_push(Key key, size_t length)
+    void load(StateReader &r)
     {
-        CacheImpl *c = new CacheImpl(key, length);
-        cache_push(c);
+        uint64_t count = r.get<uint64_t>();
+        nodes_.reserve(count);
+        for (uint64_t i = 0; i < count; i++) {
+            Key key = r.get<Key>();
+            size_t length = r.get<uint64_t>();
+            set(key, length);
+        }
     }
 
-    void move_cache_to_head(CacheImpl *c)
+private:
+    void cache_push(uint32_t n)
     {
-        cache_remove(c);
-        cache_push(c);
+        nodes_.push_front(list_, n);
+        size_ += nodes_[n].length;
     }
 
-    void cache_remove(CacheImpl *c)
+    void move_cache_to_head(uint32_t n)
     {
-        c->prev->next = c->next;
-        c->next->prev = c->prev;
-        size_ -= c->length;
+        cache_remove(n);
+        cache_push(n);
+    }
+
+    void cache_remove(uint32_t n)
+    {
+        nodes_.unlink(n);
+        size_ -= nodes_[n].length;
     }
 
-    CacheImpl *remove_last_cache()
+    uint32_t remove_last_cache()
     {
-        CacheImpl *c = tail_.prev;
-        cache_remove(c);
-        return c;
+        uint32_t n = nodes_.back(list_);
+        cache_remove(n);
+        return n;
     }
 
 private:
-    CacheImpl head_;
-    CacheImpl tail_;
+    uint32_t list_;
     size_t capacity_;
     size_t size_;
-    unordered_map<Key, CacheImpl *> vmap_;
+    NodeTable<Key> nodes_;
 };
 
 template <typename Key> class BlockCacheImpl {
@@ -281,9 +566,10 @@ public:
         BlockImpl *prev = nullptr;
     };
 
-    BlockCacheImpl(size_t capacity)
+    BlockCacheImpl(size_t capacity, size_t block_size = g_cfg.block_size)
     {
         capacity_ = capacity;
+        block_size_ = block_size;
         size_ = 0;
         head_.next = &tail_;
         head_.prev = &tail_;
@@ -318,6 +604,51 @@ public:
             cache_push(key, length);
         }
 
+        evict();
+    }
+
+    const long capacity() const { return capacity_; }
+
+    const long used() const { return size_; }
+
+    const long count() const { return vmap_.size(); }
+
+    // blocks from the least to the most recently used, then the write block
+    void save(StateWriter &w) const
+    {
+        uint64_t nblocks = 0;
+        for (const BlockImpl *b = tail_.prev; b != &head_; b = b->prev) {
+            nblocks++;
+        }
+
+        w.put<uint64_t>(vmap_.size());
+        w.put(nblocks);
+        for (const BlockImpl *b = tail_.prev; b != &head_; b = b->prev) {
+            save_block(w, b);
+        }
+        w.put<uint8_t>(wblock_ != nullptr);
+        if (wblock_ != nullptr) {
+            save_block(w, wblock_);
+        }
+    }
+
+    void load(StateReader &r)
+    {
+        vmap_.reserve(vmap_.size() + r.get<uint64_t>());
+        uint64_t nblocks = r.get<uint64_t>();
+        for (uint64_t i = 0; i < nblocks; i++) {
+            block_push(load_block(r));
+        }
+        if (r.get<uint8_t>()) {
+            wblock_ = load_block(r);
+        }
+
+        evict();
+    }
+
+private:
+    void evict()
+    {
         while (capacity_ < size_) {
             if (tail_.prev == &head_) {
                 drop_block(wblock_);
@@ -330,13 +661,39 @@ public:
         }
     }
 
-    const long capacity() const { return capacity_; }
+    // objects from the oldest, so loading them onto the front of the chain keeps order
+    static void save_block(StateWriter &w, const BlockImpl *b)
+    {
+        vector<const CacheImpl *> chain;
+        for (const CacheImpl *c = b->first; c; c = c->next) {
+            chain.push_back(c);
+        }
 
-    const long used() const { return size_; }
+        w.put<uint64_t>(b->used);
+        w.put<uint64_t>(chain.size());
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            w.put((*it)->key);
+            w.put<uint64_t>((*it)->length);
+        }
+    }
 
-    const long count() const { return vmap_.size(); }
+    BlockImpl *load_block(StateReader &r)
+    {
+        BlockImpl *b = new BlockImpl;
+        b->used = r.get<uint64_t>();
+        uint64_t count = r.get<uint64_t>();
+        for (uint64_t i = 0; i < count; i++) {
+            Key key = r.get<Key>();
+            CacheImpl *c = new CacheImpl(key, r.get<uint64_t>());
+            c->next = b->first;
+            b->first = c;
+            c->block = b;
+            size_ += c->length;
+            vmap_[key] = c;
+        }
+        return b;
+    }
 
-private:
     void cache_push(Key key, size_t length)
     {
         CacheImpl *c = new CacheImpl(key, length);
@@ -344,7 +701,7 @@ private:
             wblock_ = new BlockImpl;
         }
 
-        if (c->length + wblock_->used > 64 * 1048576) {
+        if (c->length + wblock_->used > block_size_) {
             block_push(wblock_);
             wblock_ = new BlockImpl;
         }
@@ -395,9 +752,10 @@ private:
     }
 
 private:
-    BlockImpl *wblock_;
+    BlockImpl *wblock_ = nullptr;
     size_t size_;
     size_t capacity_;
+    size_t block_size_;
     BlockImpl head_;
     BlockImpl tail_;
     unordered_map<Key, CacheImpl *> vmap_;
@@ -422,25 +780,20 @@ public:
     };
 
     struct BlockImpl {
-        BlockImpl() { score = tv_now_usec(); }
-
         CacheImpl *first = nullptr;
         uint64_t key = 0;
         uint64_t score = 0;
+        // among blocks with the same key the most recently pushed is evicted first
+        uint64_t seq = 0;
+        size_t heap_index = 0;
         size_t used = 0;
-        BlockImpl *n = nullptr;
-        BlockImpl *next = nullptr;
-        BlockImpl *prev = nullptr;
     };
 
-    BlockCacheImplV2(size_t capacity)
+    BlockCacheImplV2(size_t capacity, size_t block_size = g_cfg.block_size)
     {
         capacity_ = capacity;
+        block_size_ = block_size;
         size_ = 0;
-        head_.next = &tail_;
-        head_.prev = &tail_;
-        tail_.prev = &head_;
-        tail_.next = &head_;
     }
 
     tuple<bool, size_t> get(Key key)
@@ -451,9 +804,8 @@ public:
         } else {
             CacheImpl *c = it->second;
             if (c->block != wblock_) {
-                block_remove(c->block);
                 block_update_score(c->block, c->length);
-                block_push(c->block);
+                block_update(c->block);
             }
             return make_tuple(true, c->length);
         }
@@ -471,16 +823,7 @@ public:
             cache_push(key, length);
         }
 
-        while (capacity_ < size_) {
-            if (tail_.prev == &head_) {
-                drop_block(wblock_);
-                wblock_ = nullptr;
-            } else {
-                BlockImpl *b = block_map_.begin()->second;
-                block_remove(b);
-                drop_block(b);
-            }
-        }
+        evict();
     }
 
     const long capacity() const { return capacity_; }
@@ -489,312 +832,2967 @@ public:
 
     const long count() const { return vmap_.size(); }
 
-private:
-    void cache_push(Key key, size_t length)
+    // block scores age by this clock instead of wall time, so a replay gives the same
+    // result however fast it runs
+    void set_clock(uint64_t now) { now_ = now; }
+
+    // the clock, then blocks in heap order, then the write block
+    void save(StateWriter &w) const
     {
-        CacheImpl *c = new CacheImpl(key, length);
-        if (wblock_ == nullptr) {
-            wblock_ = new BlockImpl;
+        w.put<uint64_t>(vmap_.size());
+        w.put(now_);
+        w.put(seq_);
+        w.put<uint64_t>(heap_.size());
+        for (const BlockImpl *b : heap_) {
+            w.put(b->key);
+            w.put(b->seq);
+            save_block(w, b);
         }
-
-        if (c->length + wblock_->used > 64 * 1048576) {
-            block_push(wblock_);
-            wblock_ = new BlockImpl;
+        w.put<uint8_t>(wblock_ != nullptr);
+        if (wblock_ != nullptr) {
+            save_block(w, wblock_);
         }
-
-        c->next = wblock_->first;
-        wblock_->first = c;
-        wblock_->used += length;
-        c->block = wblock_;
-
-        size_ += length;
-        vmap_[key] = c;
     }
 
-    void block_update_score(BlockImpl *b, size_t length)
+    void load(StateReader &r)
     {
-        long delta = tv_now_usec() - b->score;
-        if (delta <= 0) {
-            return;
+        vmap_.reserve(vmap_.size() + r.get<uint64_t>());
+        now_ = r.get<uint64_t>();
+        seq_ = r.get<uint64_t>();
+        uint64_t nblocks = r.get<uint64_t>();
+        heap_.reserve(nblocks);
+        for (uint64_t i = 0; i < nblocks; i++) {
+            uint64_t key = r.get<uint64_t>();
+            uint64_t seq = r.get<uint64_t>();
+            BlockImpl *b = load_block(r);
+            b->key = key;
+            b->seq = seq;
+            // saved in heap order, so the heap needs no sifting
+            b->heap_index = heap_.size();
+            heap_.push_back(b);
         }
-
-        long new_delta = length * delta / (b->used + length);
-        if (new_delta > delta) {
-            delta = new_delta;
+        if (r.get<uint8_t>()) {
+            wblock_ = load_block(r);
         }
 
-        b->score += new_delta;
+        evict();
     }
 
-    void block_push(BlockImpl *b)
+private:
+    void evict()
+    {
+        while (capacity_ < size_) {
+            if (heap_.empty()) {
+                drop_block(wblock_);
+                wblock_ = nullptr;
+            } else {
+                BlockImpl *b = heap_.front();
+                block_remove(b);
+                drop_block(b);
+            }
+        }
+    }
+
+    // objects from the oldest, so loading them onto the front of the chain keeps order
+    static void save_block(StateWriter &w, const BlockImpl *b)
+    {
+        vector<const CacheImpl *> chain;
+        for (const CacheImpl *c = b->first; c; c = c->next) {
+            chain.push_back(c);
+        }
+
+        w.put(b->score);
+        w.put<uint64_t>(b->used);
+        w.put<uint64_t>(chain.size());
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            w.put((*it)->key);
+            w.put<uint64_t>((*it)->length);
+        }
+    }
+
+    BlockImpl *load_block(StateReader &r)
+    {
+        BlockImpl *b = new BlockImpl;
+        b->score = r.get<uint64_t>();
+        b->used = r.get<uint64_t>();
+        uint64_t count = r.get<uint64_t>();
+        for (uint64_t i = 0; i < count; i++) {
+            Key key = r.get<Key>();
+            CacheImpl *c = new CacheImpl(key, r.get<uint64_t>());
+            c->next = b->first;
+            b->first = c;
+            c->block = b;
+            size_ += c->length;
+            vmap_[key] = c;
+        }
+        return b;
+    }
+
+    void cache_push(Key key, size_t length)
+    {
+        CacheImpl *c = new CacheImpl(key, length);
+        if (wblock_ == nullptr) {
+            wblock_ = block_new();
+        }
+
+        if (c->length + wblock_->used > block_size_) {
+            block_push(wblock_);
+            wblock_ = block_new();
+        }
+
+        c->next = wblock_->first;
+        wblock_->first = c;
+        wblock_->used += length;
+        c->block = wblock_;
+
+        size_ += length;
+        vmap_[key] = c;
+    }
+
+    BlockImpl *block_new()
+    {
+        BlockImpl *b = new BlockImpl;
+        b->score = now_;
+        return b;
+    }
+
+    void block_update_score(BlockImpl *b, size_t length)
+    {
+        long delta = now_ - b->score;
+        if (delta <= 0) {
+            return;
+        }
+
+        long new_delta = length * delta / (b->used + length);
+        if (new_delta > delta) {
+            delta = new_delta;
+        }
+
+        b->score += new_delta;
+    }
+
+    // Sealed blocks live in a binary min-heap ordered by (key, -seq). Every block knows
+    // its heap slot, so a rescored block is sifted in place in O(log n).
+    static bool block_before(const BlockImpl *a, const BlockImpl *b)
+    {
+        return a->key < b->key || (a->key == b->key && a->seq > b->seq);
+    }
+
+    void block_push(BlockImpl *b)
+    {
+        b->key = b->score;
+        b->seq = ++seq_;
+        b->heap_index = heap_.size();
+        heap_.push_back(b);
+        heap_sift_up(b->heap_index);
+    }
+
+    void block_update(BlockImpl *b)
     {
-        b->next = head_.next;
-        head_.next = b;
-        b->next->prev = b;
-        b->prev = &head_;
         b->key = b->score;
+        b->seq = ++seq_;
+        heap_sift_up(b->heap_index);
+        heap_sift_down(b->heap_index);
+    }
+
+    void block_remove(BlockImpl *b)
+    {
+        size_t i = b->heap_index;
+        BlockImpl *last = heap_.back();
+        heap_.pop_back();
+        if (last != b) {
+            heap_set(i, last);
+            heap_sift_up(i);
+            heap_sift_down(last->heap_index);
+        }
+    }
+
+    void heap_set(size_t i, BlockImpl *b)
+    {
+        heap_[i] = b;
+        b->heap_index = i;
+    }
+
+    void heap_sift_up(size_t i)
+    {
+        BlockImpl *b = heap_[i];
+        while (i > 0) {
+            size_t parent = (i - 1) / 2;
+            if (!block_before(b, heap_[parent])) {
+                break;
+            }
+            heap_set(i, heap_[parent]);
+            i = parent;
+        }
+        heap_set(i, b);
+    }
+
+    void heap_sift_down(size_t i)
+    {
+        BlockImpl *b = heap_[i];
+        for (;;) {
+            size_t child = i * 2 + 1;
+            if (child >= heap_.size()) {
+                break;
+            }
+            if (child + 1 < heap_.size() && block_before(heap_[child + 1], heap_[child])) {
+                child++;
+            }
+            if (!block_before(heap_[child], b)) {
+                break;
+            }
+            heap_set(i, heap_[child]);
+            i = child;
+        }
+        heap_set(i, b);
+    }
+
+    void drop_cache(CacheImpl *c)
+    {
+        vmap_.erase(c->key);
+        size_ -= c->length;
+        delete c;
+    }
+
+    void drop_block(BlockImpl *b)
+    {
+        while (1) {
+            CacheImpl *c = b->first;
+            if (c == nullptr) {
+                break;
+            }
+
+            b->first = c->next;
+            drop_cache(c);
+        }
+
+        delete b;
+    }
+
+private:
+    BlockImpl *wblock_ = nullptr;
+    size_t size_;
+    size_t capacity_;
+    size_t block_size_;
+    uint64_t seq_ = 0;
+    uint64_t now_ = 0;
+    vector<BlockImpl *> heap_;
+    unordered_map<Key, CacheImpl *> vmap_;
+};
+
+// Log-structured flash cache. The capacity is split into segments of --block_size;
+// objects are appended to the open segment, and a full segment is sealed. When no segment
+// is free, garbage collection picks a sealed segment (the least utilized one, or the
+// oldest with --log_gc fifo), rewrites the objects hit since they were written to the
+// front of it and evicts the rest, and the segment becomes the open one. Overwritten
+// objects leave dead bytes behind in their segment. Every rewrite is one more flash write,
+// so the write amplification is (inserted + rewritten bytes) / inserted bytes.
+template <typename Key> class LogCacheImpl {
+public:
+    LogCacheImpl(size_t capacity, size_t segment_size = g_cfg.block_size)
+    {
+        segment_size_ = segment_size;
+        gc_fifo_ = g_cfg.log_gc && strcmp(g_cfg.log_gc, "fifo") == 0;
+
+        // one segment to write and at least one to collect; anything smaller would simulate
+        // a bigger cache than asked for
+        if (capacity < 2 * segment_size) {
+            log_fatal("log cache of %s is less than two --block_size segments of %s",
+                get_size_str(capacity).data(), get_size_str(segment_size).data());
+        }
+        size_t nsegments = capacity / segment_size;
+        if (capacity % segment_size != 0) {
+            log_info("log cache of %s rounded down to %lu segments of %s",
+                get_size_str(capacity).data(), nsegments, get_size_str(segment_size).data());
+        }
+        segments_.resize(nsegments);
+        for (size_t i = nsegments; i-- > 0;) {
+            segments_[i].list = nodes_.new_list();
+            free_.push_back(i);
+        }
+        open_ = take_segment();
+    }
+
+    tuple<bool, size_t> get(Key key)
+    {
+        uint32_t n = nodes_.find(key);
+        if (n == kNilNode) {
+            return make_tuple(false, 0);
+        }
+        nodes_[n].hot = true;
+        return make_tuple(true, nodes_[n].length);
+    }
+
+    void set(Key key, size_t length)
+    {
+        uint32_t n = nodes_.find(key);
+        if (n != kNilNode) {
+            // the old copy stays on flash as dead bytes until its segment is collected
+            drop(n);
+        }
+        if (length > segment_size_) {
+            return;
+        }
+
+        while (segments_[open_].written + length > segment_size_) {
+            segments_[open_].sealed_seq = ++seq_;
+            open_ = take_segment();
+        }
+
+        n = nodes_.insert(key, length);
+        nodes_[n].segment = open_;
+        nodes_.push_front(segments_[open_].list, n);
+        segments_[open_].written += length;
+        segments_[open_].live += length;
+        size_ += length;
+        inserted_ += length;
+        flash_written_ += length;
+    }
+
+    size_t capacity() const { return segments_.size() * segment_size_; }
+
+    size_t used() const { return size_; }
+
+    size_t count() const { return nodes_.size(); }
+
+    void log_summary(const char *name) const
+    {
+        log_info("%s: %s in %lu segments of %s, write amplification %.03f, %lu collected at "
+                 "%0.02f%% average utilization, rewritten %s",
+            name, get_size_str(segments_.size() * segment_size_).data(), segments_.size(),
+            get_size_str(segment_size_).data(),
+            inserted_ ? (double)flash_written_ / inserted_ : 1.0, collected_,
+            collected_ ? (double)collected_live_ / collected_ / segment_size_ * 100 : 0.0,
+            get_size_str(flash_written_ - inserted_).data());
+    }
+
+private:
+    struct Meta {
+        uint32_t segment;
+        // hit since it was last written
+        bool hot;
+    };
+
+    struct Segment {
+        // objects in the segment, newest first
+        uint32_t list;
+        size_t written = 0;
+        size_t live = 0;
+        // 0 while the segment is open or free
+        uint64_t sealed_seq = 0;
+    };
+
+    uint32_t take_segment()
+    {
+        if (!free_.empty()) {
+            uint32_t s = free_.back();
+            free_.pop_back();
+            return s;
+        }
+        return collect(pick_victim());
+    }
+
+    uint32_t pick_victim() const
+    {
+        uint32_t victim = kNilNode;
+        for (uint32_t i = 0; i < segments_.size(); i++) {
+            const Segment &s = segments_[i];
+            if (s.sealed_seq == 0) {
+                continue;
+            }
+            if (victim == kNilNode) {
+                victim = i;
+                continue;
+            }
+
+            const Segment &v = segments_[victim];
+            bool better = s.sealed_seq < v.sealed_seq;
+            if (!gc_fifo_ && s.live != v.live) {
+                better = s.live < v.live;
+            }
+            if (better) {
+                victim = i;
+            }
+        }
+        return victim;
+    }
+
+    // Hot objects are rewritten with their bit cleared, so a segment full of them frees
+    // nothing now but is evicted when collected again without new hits.
+    uint32_t collect(uint32_t victim)
+    {
+        Segment &s = segments_[victim];
+        collected_++;
+        collected_live_ += s.live;
+
+        for (uint32_t n = nodes_[s.list].next; n != s.list;) {
+            uint32_t next = nodes_[n].next;
+            if (nodes_[n].hot) {
+                nodes_[n].hot = false;
+                flash_written_ += nodes_[n].length;
+            } else {
+                drop(n);
+            }
+            n = next;
+        }
+        // what is left is rewritten from the start of the segment
+        s.written = s.live;
+        s.sealed_seq = 0;
+        return victim;
+    }
+
+    void drop(uint32_t n)
+    {
+        segments_[nodes_[n].segment].live -= nodes_[n].length;
+        size_ -= nodes_[n].length;
+        nodes_.unlink(n);
+        nodes_.erase(n);
+    }
+
+private:
+    NodeTable<Key, Meta> nodes_;
+    vector<Segment> segments_;
+    vector<uint32_t> free_;
+    uint32_t open_;
+    size_t segment_size_;
+    bool gc_fifo_;
+    uint64_t seq_ = 0;
+    size_t size_ = 0;
+    uint64_t inserted_ = 0;
+    uint64_t flash_written_ = 0;
+    uint64_t collected_ = 0;
+    uint64_t collected_live_ = 0;
+};
+
+// Count-min sketch of 4-bit counters estimating how often a key was seen recently. Each
+// key maps to four counters, its frequency is the smallest of them. Once the number of
+// increments reaches ten times the expected number of keys every counter is halved, so
+// keys that stop being requested lose their popularity.
+class FrequencySketch {
+public:
+    FrequencySketch() { ensure_capacity(16); }
+
+    // grows the table to track about n keys, growing forgets all counts
+    void ensure_capacity(size_t n)
+    {
+        if (n <= table_.size()) {
+            return;
+        }
+
+        size_t size = 16;
+        while (size < n) {
+            size *= 2;
+        }
+        table_.assign(size, 0);
+        mask_ = size * 16 - 1;
+        sample_size_ = size * 10;
+        samples_ = 0;
+    }
+
+    template <typename Key> void increment(const Key &key)
+    {
+        uint64_t h = mix64(std::hash<Key>()(key));
+        bool added = false;
+        for (int i = 0; i < 4; i++) {
+            size_t c = counter_index(h, i);
+            uint64_t &word = table_[c >> 4];
+            int shift = (c & 15) * 4;
+            if (((word >> shift) & 15) != 15) {
+                word += 1ULL << shift;
+                added = true;
+            }
+        }
+
+        if (added && ++samples_ == sample_size_) {
+            reset();
+        }
+    }
+
+    template <typename Key> int frequency(const Key &key) const
+    {
+        uint64_t h = mix64(std::hash<Key>()(key));
+        int freq = 15;
+        for (int i = 0; i < 4; i++) {
+            size_t c = counter_index(h, i);
+            freq = std::min(freq, (int)((table_[c >> 4] >> ((c & 15) * 4)) & 15));
+        }
+        return freq;
+    }
+
+private:
+    // double hashing over all counters of the table
+    size_t counter_index(uint64_t h, int i) const { return (h + i * ((h >> 32) | 1)) & mask_; }
+
+    void reset()
+    {
+        for (uint64_t &word : table_) {
+            word = (word >> 1) & 0x7777777777777777ULL;
+        }
+        samples_ /= 2;
+    }
+
+private:
+    vector<uint64_t> table_;
+    size_t mask_ = 0;
+    size_t sample_size_ = 0;
+    size_t samples_ = 0;
+};
+
+// W-TinyLFU: new objects enter a small LRU window (1% of the bytes). Objects falling out
+// of it compete with the LRU end of the main SLRU (20% probation, 80% protected) and are
+// admitted only if the sketch has seen them more often than the object they would
+// replace.
+template <typename Key> class TinyLFUCacheImpl {
+public:
+    enum { kWindow, kProbation, kProtected, kQueues };
+
+    struct Meta {
+        uint8_t queue;
+    };
+
+    TinyLFUCacheImpl(size_t capacity)
+    {
+        capacity_ = capacity;
+        size_ = 0;
+        window_capacity_ = capacity / 100;
+        protected_capacity_ = (capacity - window_capacity_) * 8 / 10;
+        for (int q = 0; q < kQueues; q++) {
+            lists_[q] = nodes_.new_list();
+            sizes_[q] = 0;
+        }
+    }
+
+    tuple<bool, size_t> get(const Key &key)
+    {
+        sketch_.increment(key);
+
+        uint32_t n = nodes_.find(key);
+        if (n == kNilNode) {
+            return make_tuple(false, 0);
+        }
+
+        switch (nodes_[n].queue) {
+        case kWindow:
+        case kProtected:
+            queue_move(nodes_[n].queue, n);
+            break;
+        case kProbation:
+            queue_move(kProtected, n);
+            while (sizes_[kProtected] > protected_capacity_) {
+                queue_move(kProbation, nodes_.back(lists_[kProtected]));
+            }
+            break;
+        }
+        return make_tuple(true, nodes_[n].length);
+    }
+
+    void set(const Key &key, size_t length)
+    {
+        uint32_t n = nodes_.find(key);
+        if (n != kNilNode) {
+            int queue = nodes_[n].queue;
+            queue_remove(n);
+            nodes_[n].length = length;
+            queue_push(queue, n);
+        } else {
+            n = nodes_.insert(key, length);
+            sketch_.ensure_capacity(nodes_.size());
+            queue_push(kWindow, n);
+        }
+
+        evict();
+    }
+
+    size_t capacity() const { return capacity_; }
+
+    size_t used() const { return size_; }
+
+    size_t count() const { return nodes_.size(); }
+
+private:
+    void evict()
+    {
+        // objects leaving the window are candidates at the LRU end of probation, oldest
+        // first, each walked towards the head as the one before it is decided
+        uint32_t candidate = kNilNode;
+        while (sizes_[kWindow] > window_capacity_) {
+            uint32_t n = nodes_.back(lists_[kWindow]);
+            queue_move(kProbation, n);
+            if (candidate == kNilNode) {
+                candidate = n;
+            }
+        }
+
+        while (capacity_ < size_) {
+            uint32_t victim = kNilNode;
+            for (int q : { kProbation, kProtected, kWindow }) {
+                victim = nodes_.back(lists_[q]);
+                if (victim != lists_[q]) {
+                    break;
+                }
+            }
+
+            if (candidate != kNilNode && candidate != victim
+                && sketch_.frequency(nodes_[candidate].key)
+                    > sketch_.frequency(nodes_[victim].key)) {
+                drop(victim);
+                continue;
+            }
+
+            if (candidate != kNilNode) {
+                victim = candidate;
+                candidate = nodes_[candidate].prev;
+                if (candidate == lists_[kProbation]) {
+                    candidate = kNilNode;
+                }
+            }
+            drop(victim);
+        }
+    }
+
+    void queue_push(int queue, uint32_t n)
+    {
+        nodes_[n].queue = queue;
+        nodes_.push_front(lists_[queue], n);
+        sizes_[queue] += nodes_[n].length;
+        size_ += nodes_[n].length;
+    }
+
+    void queue_remove(uint32_t n)
+    {
+        nodes_.unlink(n);
+        sizes_[nodes_[n].queue] -= nodes_[n].length;
+        size_ -= nodes_[n].length;
+    }
+
+    void queue_move(int queue, uint32_t n)
+    {
+        queue_remove(n);
+        queue_push(queue, n);
+    }
+
+    void drop(uint32_t n)
+    {
+        queue_remove(n);
+        nodes_.erase(n);
+    }
+
+private:
+    uint32_t lists_[kQueues];
+    size_t sizes_[kQueues];
+    size_t capacity_;
+    size_t size_;
+    size_t window_capacity_;
+    size_t protected_capacity_;
+    FrequencySketch sketch_;
+    NodeTable<Key, Meta> nodes_;
+};
+
+// Adaptive Replacement Cache, weighted by bytes. T1 holds objects seen once recently, T2
+// objects seen at least twice; B1 and B2 remember the keys evicted from each. A hit in
+// B1 means T1 was too small and grows its target p, a hit in B2 shrinks it.
+template <typename Key> class ARCCacheImpl {
+public:
+    enum { kT1, kT2, kB1, kB2, kQueues };
+
+    struct Meta {
+        uint8_t queue;
+    };
+
+    ARCCacheImpl(size_t capacity)
+    {
+        capacity_ = capacity;
+        p_ = 0;
+        ghosts_ = 0;
+        for (int q = 0; q < kQueues; q++) {
+            lists_[q] = nodes_.new_list();
+            sizes_[q] = 0;
+        }
+    }
+
+    tuple<bool, size_t> get(const Key &key)
+    {
+        uint32_t n = nodes_.find(key);
+        if (n == kNilNode || is_ghost(n)) {
+            return make_tuple(false, 0);
+        }
+
+        queue_move(kT2, n);
+        return make_tuple(true, nodes_[n].length);
+    }
+
+    void set(const Key &key, size_t length)
+    {
+        bool in_b2 = false;
+        uint32_t n = nodes_.find(key);
+        if (n != kNilNode && !is_ghost(n)) {
+            int queue = nodes_[n].queue;
+            queue_remove(n);
+            nodes_[n].length = length;
+            queue_push(queue, n);
+        } else if (n != kNilNode) {
+            // the ratio of the ghost lists sets how fast p moves, as in the paper
+            if (nodes_[n].queue == kB1) {
+                size_t ratio = std::max<size_t>(sizes_[kB2] / std::max<size_t>(sizes_[kB1], 1), 1);
+                p_ = std::min(capacity_, p_ + ratio * length);
+            } else {
+                size_t ratio = std::max<size_t>(sizes_[kB1] / std::max<size_t>(sizes_[kB2], 1), 1);
+                p_ -= std::min(p_, ratio * length);
+                in_b2 = true;
+            }
+            queue_remove(n);
+            ghosts_--;
+            nodes_[n].length = length;
+            queue_push(kT2, n);
+        } else {
+            n = nodes_.insert(key, length);
+            queue_push(kT1, n);
+        }
+
+        while (capacity_ < used()) {
+            replace(in_b2);
+        }
+
+        while (capacity_ < sizes_[kT1] + sizes_[kB1] && !queue_empty(kB1)) {
+            drop(nodes_.back(lists_[kB1]));
+        }
+        while (capacity_ * 2 < used() + sizes_[kB1] + sizes_[kB2] && !queue_empty(kB2)) {
+            drop(nodes_.back(lists_[kB2]));
+        }
+    }
+
+    size_t capacity() const { return capacity_; }
+
+    size_t used() const { return sizes_[kT1] + sizes_[kT2]; }
+
+    size_t count() const { return nodes_.size() - ghosts_; }
+
+private:
+    // evicts the LRU end of T1 or T2 into its ghost list
+    void replace(bool in_b2)
+    {
+        int from = kT2;
+        if (!queue_empty(kT1)
+            && (sizes_[kT1] > p_ || (in_b2 && sizes_[kT1] == p_) || queue_empty(kT2))) {
+            from = kT1;
+        }
+
+        uint32_t n = nodes_.back(lists_[from]);
+        queue_move(from == kT1 ? kB1 : kB2, n);
+        ghosts_++;
+    }
+
+    bool is_ghost(uint32_t n) const { return nodes_[n].queue >= kB1; }
+
+    bool queue_empty(int queue) const { return nodes_.back(lists_[queue]) == lists_[queue]; }
+
+    void queue_push(int queue, uint32_t n)
+    {
+        nodes_[n].queue = queue;
+        nodes_.push_front(lists_[queue], n);
+        sizes_[queue] += nodes_[n].length;
+    }
+
+    void queue_remove(uint32_t n)
+    {
+        nodes_.unlink(n);
+        sizes_[nodes_[n].queue] -= nodes_[n].length;
+    }
+
+    void queue_move(int queue, uint32_t n)
+    {
+        queue_remove(n);
+        queue_push(queue, n);
+    }
+
+    // forgets a ghost
+    void drop(uint32_t n)
+    {
+        queue_remove(n);
+        nodes_.erase(n);
+        ghosts_--;
+    }
+
+private:
+    uint32_t lists_[kQueues];
+    size_t sizes_[kQueues];
+    size_t capacity_;
+    // target size of T1 in bytes
+    size_t p_;
+    size_t ghosts_;
+    NodeTable<Key, Meta> nodes_;
+};
+
+// S3-FIFO: new objects enter a small FIFO (10% of the bytes). Those hit again while in
+// it move to the main FIFO, the rest are evicted and remembered in a ghost FIFO, so
+// their next miss inserts them straight into main. Main evicts lazily, reinserting
+// objects with a non-zero 2-bit frequency after decrementing it.
+template <typename Key> class S3FIFOCacheImpl {
+public:
+    enum { kSmall, kMain, kGhost, kQueues };
+
+    struct Meta {
+        uint8_t queue;
+        uint8_t freq;
+    };
+
+    S3FIFOCacheImpl(size_t capacity)
+    {
+        capacity_ = capacity;
+        small_capacity_ = capacity / 10;
+        ghosts_ = 0;
+        for (int q = 0; q < kQueues; q++) {
+            lists_[q] = nodes_.new_list();
+            sizes_[q] = 0;
+        }
+    }
+
+    tuple<bool, size_t> get(const Key &key)
+    {
+        uint32_t n = nodes_.find(key);
+        if (n == kNilNode || nodes_[n].queue == kGhost) {
+            return make_tuple(false, 0);
+        }
+
+        if (nodes_[n].freq < 3) {
+            nodes_[n].freq++;
+        }
+        return make_tuple(true, nodes_[n].length);
+    }
+
+    void set(const Key &key, size_t length)
+    {
+        uint32_t n = nodes_.find(key);
+        if (n != kNilNode && nodes_[n].queue != kGhost) {
+            // FIFO order is kept, only the size changes
+            sizes_[nodes_[n].queue] += length - nodes_[n].length;
+            nodes_[n].length = length;
+        } else if (n != kNilNode) {
+            queue_remove(n);
+            ghosts_--;
+            nodes_[n].length = length;
+            nodes_[n].freq = 0;
+            queue_push(kMain, n);
+        } else {
+            n = nodes_.insert(key, length);
+            queue_push(kSmall, n);
+        }
+
+        while (capacity_ < used()) {
+            if (sizes_[kSmall] > small_capacity_ || queue_empty(kMain)) {
+                evict_small();
+            } else {
+                evict_main();
+            }
+        }
+
+        // the ghost FIFO remembers about as many bytes as main holds
+        while (capacity_ - small_capacity_ < sizes_[kGhost]) {
+            uint32_t g = nodes_.back(lists_[kGhost]);
+            queue_remove(g);
+            nodes_.erase(g);
+            ghosts_--;
+        }
+    }
+
+    size_t capacity() const { return capacity_; }
+
+    size_t used() const { return sizes_[kSmall] + sizes_[kMain]; }
+
+    size_t count() const { return nodes_.size() - ghosts_; }
+
+private:
+    void evict_small()
+    {
+        uint32_t n = nodes_.back(lists_[kSmall]);
+        queue_remove(n);
+        if (nodes_[n].freq > 0) {
+            nodes_[n].freq = 0;
+            queue_push(kMain, n);
+        } else {
+            queue_push(kGhost, n);
+            ghosts_++;
+        }
+    }
+
+    void evict_main()
+    {
+        for (;;) {
+            uint32_t n = nodes_.back(lists_[kMain]);
+            queue_remove(n);
+            if (nodes_[n].freq == 0) {
+                nodes_.erase(n);
+                return;
+            }
+            nodes_[n].freq--;
+            queue_push(kMain, n);
+        }
+    }
+
+    bool queue_empty(int queue) const { return nodes_.back(lists_[queue]) == lists_[queue]; }
+
+    void queue_push(int queue, uint32_t n)
+    {
+        nodes_[n].queue = queue;
+        nodes_.push_front(lists_[queue], n);
+        sizes_[queue] += nodes_[n].length;
+    }
+
+    void queue_remove(uint32_t n)
+    {
+        nodes_.unlink(n);
+        sizes_[nodes_[n].queue] -= nodes_[n].length;
+    }
+
+private:
+    uint32_t lists_[kQueues];
+    size_t sizes_[kQueues];
+    size_t capacity_;
+    size_t small_capacity_;
+    size_t ghosts_;
+    NodeTable<Key, Meta> nodes_;
+};
+
+// LIRS, weighted by bytes. Objects with a short reuse distance (LIR) get 99% of the
+// bytes, the rest go to resident HIR objects, which are evicted first in FIFO order.
+// The stack S orders recent accesses of LIR, HIR and non-resident HIR objects and is
+// pruned so its bottom is always LIR; a HIR object hit while still in S has been reused
+// more recently than the oldest LIR one and takes its place. Non-resident objects are
+// kept for up to capacity bytes.
+template <typename Key> class LIRSCacheImpl {
+public:
+    enum { kLIR, kHIR, kNonResident };
+
+    // prev/next link a node into S, qprev/qnext into the HIR queue or the non-resident list
+    struct Meta {
+        uint8_t state;
+        bool in_stack;
+        uint32_t qprev;
+        uint32_t qnext;
+    };
+
+    LIRSCacheImpl(size_t capacity)
+    {
+        capacity_ = capacity;
+        lir_capacity_ = capacity - capacity / 100;
+        lir_size_ = 0;
+        hir_size_ = 0;
+        non_resident_size_ = 0;
+        non_residents_ = 0;
+        stack_ = nodes_.new_list();
+        hir_ = new_queue();
+        non_resident_ = new_queue();
+    }
+
+    tuple<bool, size_t> get(const Key &key)
+    {
+        uint32_t n = nodes_.find(key);
+        if (n == kNilNode || nodes_[n].state == kNonResident) {
+            return make_tuple(false, 0);
+        }
+
+        if (nodes_[n].state == kLIR) {
+            stack_move_top(n);
+            prune();
+        } else if (nodes_[n].in_stack) {
+            stack_move_top(n);
+            queue_unlink(n);
+            hir_size_ -= nodes_[n].length;
+            nodes_[n].state = kLIR;
+            lir_size_ += nodes_[n].length;
+            demote_lirs();
+        } else {
+            stack_move_top(n);
+            queue_unlink(n);
+            queue_push_front(hir_, n);
+        }
+        return make_tuple(true, nodes_[n].length);
+    }
+
+    void set(const Key &key, size_t length)
+    {
+        uint32_t n = nodes_.find(key);
+        if (n != kNilNode && nodes_[n].state != kNonResident) {
+            size_t &size = nodes_[n].state == kLIR ? lir_size_ : hir_size_;
+            size += length - nodes_[n].length;
+            nodes_[n].length = length;
+            demote_lirs();
+        } else if (n != kNilNode) {
+            queue_unlink(n);
+            non_resident_size_ -= nodes_[n].length;
+            non_residents_--;
+            nodes_[n].length = length;
+            nodes_[n].state = kLIR;
+            lir_size_ += length;
+            stack_move_top(n);
+            demote_lirs();
+        } else {
+            n = nodes_.insert(key, length);
+            stack_move_top(n);
+            if (lir_size_ + length <= lir_capacity_) {
+                nodes_[n].state = kLIR;
+                lir_size_ += length;
+            } else {
+                nodes_[n].state = kHIR;
+                queue_push_front(hir_, n);
+                hir_size_ += length;
+            }
+        }
+
+        while (capacity_ < used()) {
+            evict();
+        }
+
+        while (capacity_ < non_resident_size_) {
+            uint32_t g = nodes_[non_resident_].qprev;
+            queue_unlink(g);
+            non_resident_size_ -= nodes_[g].length;
+            non_residents_--;
+            // never the bottom of S, which is LIR
+            nodes_.unlink(g);
+            nodes_.erase(g);
+        }
+    }
+
+    size_t capacity() const { return capacity_; }
+
+    size_t used() const { return lir_size_ + hir_size_; }
+
+    size_t count() const { return nodes_.size() - non_residents_; }
+
+private:
+    void evict()
+    {
+        if (nodes_[hir_].qprev == hir_) {
+            demote_bottom_lir();
+        }
+
+        uint32_t n = nodes_[hir_].qprev;
+        queue_unlink(n);
+        hir_size_ -= nodes_[n].length;
+        if (nodes_[n].in_stack) {
+            nodes_[n].state = kNonResident;
+            queue_push_front(non_resident_, n);
+            non_resident_size_ += nodes_[n].length;
+            non_residents_++;
+        } else {
+            nodes_.erase(n);
+        }
+    }
+
+    void demote_lirs()
+    {
+        while (lir_capacity_ < lir_size_) {
+            demote_bottom_lir();
+        }
+    }
+
+    void demote_bottom_lir()
+    {
+        prune();
+        uint32_t n = nodes_.back(stack_);
+        nodes_.unlink(n);
+        nodes_[n].in_stack = false;
+        nodes_[n].state = kHIR;
+        lir_size_ -= nodes_[n].length;
+        hir_size_ += nodes_[n].length;
+        queue_push_front(hir_, n);
+        prune();
+    }
+
+    // pops HIR objects off the bottom of S, forgetting the non-resident ones
+    void prune()
+    {
+        for (;;) {
+            uint32_t n = nodes_.back(stack_);
+            if (n == stack_ || nodes_[n].state == kLIR) {
+                return;
+            }
+            nodes_.unlink(n);
+            nodes_[n].in_stack = false;
+            if (nodes_[n].state == kNonResident) {
+                queue_unlink(n);
+                non_resident_size_ -= nodes_[n].length;
+                non_residents_--;
+                nodes_.erase(n);
+            }
+        }
+    }
+
+    void stack_move_top(uint32_t n)
+    {
+        if (nodes_[n].in_stack) {
+            nodes_.unlink(n);
+        }
+        nodes_[n].in_stack = true;
+        nodes_.push_front(stack_, n);
+    }
+
+    uint32_t new_queue()
+    {
+        uint32_t q = nodes_.new_list();
+        nodes_[q].qprev = q;
+        nodes_[q].qnext = q;
+        return q;
+    }
+
+    void queue_push_front(uint32_t queue, uint32_t n)
+    {
+        nodes_[n].qnext = nodes_[queue].qnext;
+        nodes_[n].qprev = queue;
+        nodes_[nodes_[n].qnext].qprev = n;
+        nodes_[queue].qnext = n;
+    }
+
+    void queue_unlink(uint32_t n)
+    {
+        nodes_[nodes_[n].qprev].qnext = nodes_[n].qnext;
+        nodes_[nodes_[n].qnext].qprev = nodes_[n].qprev;
+    }
+
+private:
+    uint32_t stack_;
+    // resident HIR objects, evicted from the back
+    uint32_t hir_;
+    uint32_t non_resident_;
+    size_t capacity_;
+    size_t lir_capacity_;
+    size_t lir_size_;
+    size_t hir_size_;
+    size_t non_resident_size_;
+    size_t non_residents_;
+    NodeTable<Key, Meta> nodes_;
+};
+
+static uint64_t g_current_ticks = 0;
+
+// Object lengths in HDR-style buckets: exact below 8, then 8 linear sub-buckets per
+// power of two, so a bucket is never wider than 12.5% of the lengths it holds.
+struct LengthHistogram {
+    static constexpr int kBuckets = 62 * 8;
+
+    static int bucket(uint64_t length)
+    {
+        if (length < 8) {
+            return length;
+        }
+        int msb = 63 - __builtin_clzll(length);
+        return (msb - 2) * 8 + ((length >> (msb - 3)) & 7);
+    }
+
+    // smallest length falling into bucket b
+    static uint64_t floor(int b)
+    {
+        if (b < 8) {
+            return b;
+        }
+        return (uint64_t)(8 + b % 8) << (b / 8 - 1);
+    }
+
+    // length below which fraction p of the samples fall
+    static uint64_t percentile(const uint64_t *histogram, double p)
+    {
+        uint64_t total = 0;
+        for (int b = 0; b < kBuckets; b++) {
+            total += histogram[b];
+        }
+
+        uint64_t rank = total * p;
+        uint64_t seen = 0;
+        for (int b = 0; b < kBuckets; b++) {
+            seen += histogram[b];
+            if (seen > rank) {
+                return floor(b);
+            }
+        }
+        return 0;
+    }
+};
+
+// Counters of one cache. Only the thread replaying requests into the cache writes them
+// (the main thread, or the cache's pipeline worker), so an update is a relaxed load and
+// store with no locked instruction, and any thread may read a snapshot at any time.
+// Totals are not kept on the request path; a snapshot sums them from the histograms.
+class StatCounters {
+public:
+    static constexpr int kGroups = 64;
+
+    // arrays indexed by is_hit
+    struct Snapshot {
+        uint64_t count[2] = {};
+        uint64_t length[2] = {};
+        uint64_t histogram[2][LengthHistogram::kBuckets] = {};
+        uint64_t group_count[2][kGroups] = {};
+        uint64_t group_length[2][kGroups] = {};
+    };
+
+    // count requests of the same key, length bytes in all
+    void add(uint64_t key, size_t length, bool is_hit, uint64_t count = 1)
+    {
+        bump(histogram_[is_hit][LengthHistogram::bucket(length / count)], count);
+        bump(length_[is_hit], length);
+
+        // keys fall into random groups, the spread of hit ratios between groups gives
+        // the error of the ratio when only a sample of the keys is replayed
+        int group = (mix64(key) >> 32) % kGroups;
+        bump(group_count_[is_hit][group], count);
+        bump(group_length_[is_hit][group], length);
+    }
+
+    Snapshot snapshot() const
+    {
+        Snapshot s;
+        for (int h = 0; h < 2; h++) {
+            s.length[h] = length_[h].load(std::memory_order_relaxed);
+            for (int b = 0; b < LengthHistogram::kBuckets; b++) {
+                s.histogram[h][b] = histogram_[h][b].load(std::memory_order_relaxed);
+                s.count[h] += s.histogram[h][b];
+            }
+            for (int g = 0; g < kGroups; g++) {
+                s.group_count[h][g] = group_count_[h][g].load(std::memory_order_relaxed);
+                s.group_length[h][g] = group_length_[h][g].load(std::memory_order_relaxed);
+            }
+        }
+        return s;
+    }
+
+private:
+    static void bump(std::atomic<uint64_t> &counter, uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> length_[2] = {};
+    std::atomic<uint64_t> histogram_[2][LengthHistogram::kBuckets] = {};
+    std::atomic<uint64_t> group_count_[2][kGroups] = {};
+    std::atomic<uint64_t> group_length_[2][kGroups] = {};
+};
+
+// Formats the interval logs on a background thread. A cache crossing an interval hands
+// over its numbers for the interval and goes on replaying; reports are logged in the
+// order they were posted.
+class StatsReporter {
+public:
+    struct Report {
+        CacheStat::Stat stat;
+        long hit_count;
+        long miss_count;
+        long hit_length;
+        long miss_length;
+    };
+
+    ~StatsReporter() { flush(); }
+
+    void post(Report report)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!thread_.joinable()) {
+            stopped_ = false;
+            thread_ = std::thread([this] { run(); });
+        }
+        reports_.push_back(std::move(report));
+        cond_.notify_one();
+    }
+
+    // logs every report posted so far and stops the thread
+    void flush()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!thread_.joinable()) {
+                return;
+            }
+            stopped_ = true;
+            cond_.notify_one();
+        }
+        thread_.join();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            cond_.wait(lock, [this] { return stopped_ || !reports_.empty(); });
+            if (reports_.empty()) {
+                return;
+            }
+            Report report = std::move(reports_.front());
+            reports_.pop_front();
+
+            lock.unlock();
+            interval_log(report);
+            lock.lock();
+        }
+    }
+
+    static void interval_log(const Report &r)
+    {
+        const CacheStat::Stat &st = r.stat;
+        log_info("%s: hit_count = %ld, miss_count = %ld, rate is %0.02f%%", st.class_name.data(),
+            r.hit_count, r.miss_count, (double)r.hit_count / (r.hit_count + r.miss_count) * 100);
+        log_info("%s: hit_length = %s, miss_length = %s, rate is %0.02f%%", st.class_name.data(),
+            get_size_str(r.hit_length).data(), get_size_str(r.miss_length).data(),
+            (double)r.hit_length / (r.hit_length + r.miss_length) * 100);
+
+        log_info("%s: count = %ld, in use %s/%s", st.class_name.data(), st.count,
+            get_size_str(st.used).data(), get_size_str(st.capacity).data());
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<Report> reports_;
+    std::thread thread_;
+    bool stopped_ = false;
+};
+
+static StatsReporter g_reporter;
+
+class CacheStatImpl : public CacheStat {
+public:
+    void on_get(uint64_t key, const size_t length, bool is_hit) override
+    {
+        log_debug("get key %016lx, length %lu, result %s", key, length, is_hit ? "HIT" : "MISS");
+
+        counters_.add(key, length, is_hit);
+        tick(1);
+    }
+
+    // count parts of one object with the same result, length bytes in all
+    void on_get_parts(uint64_t key, uint64_t count, size_t length, bool is_hit)
+    {
+        log_debug("get key %016lx, %lu parts, length %lu, result %s", key, count, length,
+            is_hit ? "HIT" : "MISS");
+
+        counters_.add(key, length, is_hit, count);
+        tick(count);
+    }
+
+    void log_summary() const override
+    {
+        StatCounters::Snapshot s = counters_.snapshot();
+        long total_c = s.count[0] + s.count[1];
+        long total_l = s.length[0] + s.length[1];
+        if (total_c == 0) {
+            return;
+        }
+
+        uint64_t group_total_count[kGroups];
+        uint64_t group_total_length[kGroups];
+        for (int g = 0; g < kGroups; g++) {
+            group_total_count[g] = s.group_count[0][g] + s.group_count[1][g];
+            group_total_length[g] = s.group_length[0][g] + s.group_length[1][g];
+        }
+
+        Stat st = get_stat();
+        log_info("%s: total hit_count = %ld, miss_count = %ld, rate is %0.02f%%%s",
+            st.class_name.data(), st.hit_count, st.miss_count, (double)st.hit_count / total_c * 100,
+            error_str(s.group_count[1], group_total_count).data());
+        log_info("%s: total hit_length = %s, miss_length = %s, rate is %0.02f%%%s",
+            st.class_name.data(), get_size_str(st.hit_length).data(),
+            get_size_str(st.miss_length).data(), (double)st.hit_length / total_l * 100,
+            error_str(s.group_length[1], group_total_length).data());
+        auto size_at = [](const uint64_t *histogram, double p) {
+            return get_size_str(LengthHistogram::percentile(histogram, p));
+        };
+        log_info("%s: total object size of hits p50 = %s, p99 = %s, of misses p50 = %s, p99 = %s",
+            st.class_name.data(), size_at(s.histogram[1], 0.5).data(),
+            size_at(s.histogram[1], 0.99).data(), size_at(s.histogram[0], 0.5).data(),
+            size_at(s.histogram[0], 0.99).data());
+    }
+
+    StatCounters::Snapshot snapshot() const { return counters_.snapshot(); }
+
+protected:
+    // fills the counters of a Stat from a snapshot
+    static void fill_stat(Stat &stat, const StatCounters::Snapshot &s)
+    {
+        stat.hit_count = s.count[1];
+        stat.miss_count = s.count[0];
+        stat.hit_length = s.length[1];
+        stat.miss_length = s.length[0];
+    }
+
+private:
+    // every cache sees every request, so its own tick count matches the global one
+    // even when it runs on a pipeline worker behind the parser
+    void tick(uint64_t n)
+    {
+        ticks_ += n;
+        if (g_cfg.interval > 0 && ticks_ >= next_interval_) {
+            // a range may cross several intervals, they share one report
+            next_interval_ = (ticks_ / g_cfg.interval + 1) * g_cfg.interval;
+            post_interval();
+        }
+    }
+
+    void post_interval()
+    {
+        Stat st = get_stat();
+        StatsReporter::Report report { st, st.hit_count - last_.hit_count,
+            st.miss_count - last_.miss_count, st.hit_length - last_.hit_length,
+            st.miss_length - last_.miss_length };
+        last_ = st;
+        g_reporter.post(std::move(report));
+    }
+
+    // 95% confidence half-width of sum(hits) / sum(totals), estimated from the variance
+    // between key groups; only meaningful when the keys are sampled
+    static string error_str(const uint64_t *hits, const uint64_t *totals)
+    {
+        if (g_cfg.sample_rate >= 1) {
+            return "";
+        }
+
+        double sum_hits = 0;
+        double sum_totals = 0;
+        for (int i = 0; i < kGroups; i++) {
+            sum_hits += hits[i];
+            sum_totals += totals[i];
+        }
+        if (sum_totals == 0) {
+            return "";
+        }
+
+        double ratio = sum_hits / sum_totals;
+        double ss = 0;
+        for (int i = 0; i < kGroups; i++) {
+            double d = hits[i] - ratio * totals[i];
+            ss += d * d;
+        }
+        double se = std::sqrt(ss * kGroups / (kGroups - 1)) / sum_totals;
+
+        char buf[64];
+        snprintf(buf, sizeof(buf), " +/- %0.02f%%", 1.96 * se * 100);
+        return buf;
+    }
+
+private:
+    static constexpr int kGroups = StatCounters::kGroups;
+
+    StatCounters counters_;
+    // owned by the writer, like the counters
+    uint64_t ticks_ = 0;
+    uint64_t next_interval_ = g_cfg.interval;
+    Stat last_ = {};
+};
+
+// passes the logical clock to the policies that age by it
+template <typename Impl>
+static auto impl_set_clock(Impl &impl, uint64_t now, int) -> decltype(impl.set_clock(now))
+{
+    impl.set_clock(now);
+}
+
+template <typename Impl> static void impl_set_clock(Impl &, uint64_t, long) { }
+
+// state files for the policies that can save and load their state
+template <typename Impl>
+static auto impl_save(const Impl &impl, StateWriter &w, int) -> decltype(impl.save(w), true)
+{
+    impl.save(w);
+    return true;
+}
+
+template <typename Impl> static bool impl_save(const Impl &, StateWriter &, long) { return false; }
+
+template <typename Impl>
+static auto impl_load(Impl &impl, StateReader &r, int) -> decltype(impl.load(r), true)
+{
+    impl.load(r);
+    return true;
+}
+
+template <typename Impl> static bool impl_load(Impl &, StateReader &, long) { return false; }
+
+// extra summary lines of the policies that have more to report
+template <typename Impl>
+static auto impl_log_summary(const Impl &impl, const char *name, int)
+    -> decltype(impl.log_summary(name))
+{
+    impl.log_summary(name);
+}
+
+template <typename Impl> static void impl_log_summary(const Impl &, const char *, long) { }
+
+// Admission stage in front of any policy: a missed object is only stored once the
+// frequency sketch has seen it --admission times, so the one-hit wonders of a scan
+// never displace what is cached.
+template <typename Impl> class AdmissionImpl {
+public:
+    AdmissionImpl(size_t capacity)
+        : impl_(capacity)
+    {
+        min_freq_ = g_cfg.admission;
+    }
+
+    template <typename Key> tuple<bool, size_t> get(const Key &key)
+    {
+        sketch_.increment(key);
+        auto result = impl_.get(key);
+        last_hit_ = std::get<0>(result);
+        return result;
+    }
+
+    template <typename Key> void set(const Key &key, size_t length)
+    {
+        // TCache calls set right after get of the same key, a hit there means only the
+        // length of a cached object changed
+        if (!last_hit_ && sketch_.frequency(key) < min_freq_) {
+            return;
+        }
+        impl_.set(key, length);
+        sketch_.ensure_capacity(impl_.count());
+    }
+
+    void set_clock(uint64_t now) { impl_set_clock(impl_, now, 0); }
+
+    // the sketch is not saved, a restored cache relearns frequencies
+    template <typename I = Impl>
+    auto save(StateWriter &w) const -> decltype(std::declval<const I &>().save(w))
+    {
+        impl_.save(w);
+    }
+
+    template <typename I = Impl> auto load(StateReader &r) -> decltype(std::declval<I &>().load(r))
+    {
+        impl_.load(r);
+    }
+
+    void log_summary(const char *name) const { impl_log_summary(impl_, name, 0); }
+
+    long capacity() const { return impl_.capacity(); }
+
+    long used() const { return impl_.used(); }
+
+    long count() const { return impl_.count(); }
+
+private:
+    Impl impl_;
+    FrequencySketch sketch_;
+    int min_freq_;
+    bool last_hit_ = false;
+};
+
+template <typename Impl> class TCache : public Cache, public CacheStatImpl {
+public:
+    TCache(size_t cap)
+        : impl_(cap)
+    {
+    }
+
+    void get(uint64_t key, const size_t length, uint64_t now) override
+    {
+        impl_set_clock(impl_, now, 0);
+        auto [is_hit, old_length] = impl_.get(key);
+        if (!is_hit || old_length != length) {
+            is_hit = false;
+            impl_.set(key, length);
+        }
+        on_get(key, length, is_hit);
+    }
+
+    Stat get_stat() const override
+    {
+        Stat stat;
+        stat.class_name = string(type_name<decltype(*this)>());
+        stat.capacity = impl_.capacity();
+        stat.count = impl_.count();
+        stat.used = impl_.used();
+        fill_stat(stat, snapshot());
+        return stat;
+    }
+
+    bool save_state(StateWriter &w) const override { return impl_save(impl_, w, 0); }
+
+    bool load_state(StateReader &r) override { return impl_load(impl_, r, 0); }
+
+    void log_summary() const override
+    {
+        CacheStatImpl::log_summary();
+        impl_log_summary(impl_, string(type_name<decltype(*this)>()).data(), 0);
+    }
+
+private:
+    Impl impl_;
+};
+
+// every policy can sit behind the admission stage when --admission is set
+template <typename Impl> static shared_ptr<Cache> make_cache(size_t capacity)
+{
+    if (g_cfg.admission > 0) {
+        return make_shared<TCache<AdmissionImpl<Impl>>>(capacity);
+    }
+    return make_shared<TCache<Impl>>(capacity);
+}
+
+// Trace keys are interned once at parse time into 64-bit fingerprints, so every
+// policy stores and compares 8 bytes per object instead of a copy of the key string.
+// At 100M distinct keys the chance of any collision is still below 1e-3.
+static const uint64_t kKeySeed = 0x1F0D3804;
+
+static uint64_t key_fingerprint(const char *data, size_t len, uint64_t seed = kKeySeed)
+{
+    return murmur_hash64a(data, len, seed);
+}
+
+static uint64_t part_fingerprint(uint64_t object_key, uint64_t part_index)
+{
+    return murmur_hash64a(&part_index, sizeof(part_index), object_key);
+}
+
+static size_t part_size(size_t entity_length, size_t part_index)
+{
+    if ((part_index + 1) * 1048576 <= entity_length) {
+        return 1048576;
+    }
+    if (part_index * 1048576 > entity_length) {
+        return 1048576;
+    }
+    return entity_length - part_index * 1048576;
+}
+
+struct Request {
+    uint64_t key;
+    uint64_t length;
+    // taken from the trace when it has one, 0 otherwise. Requests handed to the caches
+    // carry the logical clock here instead.
+    uint64_t ts;
+};
+
+// a start-end slice of the 1MB parts of an object, handed over whole with --range
+struct RangeRequest {
+    uint64_t key;
+    uint64_t entity_length;
+    uint32_t first;
+    uint32_t last;
+    uint64_t ts;
+};
+
+// Single-producer single-consumer ring of requests. Both sides move whole batches and
+// publish their position once per batch, so the shared cache lines bounce once per
+// batch instead of once per request.
+class RequestRing {
+public:
+    // capacity must be a power of two
+    explicit RequestRing(size_t capacity)
+        : buf_(capacity)
+        , mask_(capacity - 1)
+    {
+    }
+
+    void push(const Request *reqs, size_t n)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        while (tail + n - head_.load(std::memory_order_acquire) > buf_.size()) {
+            std::this_thread::yield();
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            buf_[(tail + i) & mask_] = reqs[i];
+        }
+        tail_.store(tail + n, std::memory_order_release);
+    }
+
+    void close() { closed_.store(true, std::memory_order_release); }
+
+    // calls fn on every request until the ring is closed and drained
+    template <typename Fn> void consume(Fn fn, size_t batch_size)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            size_t tail = tail_.load(std::memory_order_acquire);
+            if (tail == head) {
+                if (closed_.load(std::memory_order_acquire)
+                    && tail_.load(std::memory_order_acquire) == head) {
+                    break;
+                }
+                std::this_thread::yield();
+                continue;
+            }
+
+            if (tail - head > batch_size) {
+                tail = head + batch_size;
+            }
+            for (; head != tail; head++) {
+                fn(buf_[head & mask_]);
+            }
+            head_.store(head, std::memory_order_release);
+        }
+    }
+
+private:
+    vector<Request> buf_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_ { 0 };
+    alignas(64) std::atomic<size_t> tail_ { 0 };
+    alignas(64) std::atomic<bool> closed_ { false };
+};
+
+// Fans requests out to one worker thread per cache. The parser thread collects
+// requests into a batch and copies each full batch into every worker's ring, so
+// adding a policy costs a core rather than wall time.
+class Pipeline {
+public:
+    static constexpr size_t kBatchSize = 1024;
+    static constexpr size_t kRingSize = 65536;
+
+    explicit Pipeline(const vector<shared_ptr<Cache>> &caches)
+    {
+        batch_.reserve(kBatchSize);
+
+        for (const auto &cache : caches) {
+            rings_.emplace_back(make_unique<RequestRing>(kRingSize));
+            RequestRing *ring = rings_.back().get();
+            Cache *c = cache.get();
+            workers_.emplace_back([ring, c] {
+                ring->consume([c](const Request &req) { c->get(req.key, req.length, req.ts); },
+                    kBatchSize);
+            });
+        }
+    }
+
+    void push(const Request &req)
+    {
+        batch_.push_back(req);
+        if (batch_.size() == kBatchSize) {
+            flush();
+        }
+    }
+
+    // drains every ring and joins the workers
+    void finish()
+    {
+        flush();
+        for (auto &ring : rings_) {
+            ring->close();
+        }
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+    }
+
+private:
+    void flush()
+    {
+        for (auto &ring : rings_) {
+            ring->push(batch_.data(), batch_.size());
+        }
+        batch_.clear();
+    }
+
+private:
+    vector<Request> batch_;
+    vector<unique_ptr<RequestRing>> rings_;
+    vector<std::thread> workers_;
+};
+
+// Byte-weighted LRU stack distances, giving the hit ratio of LRU at every capacity of
+// a list in one pass. Each key sits at the position of its last access in a Fenwick
+// tree holding object lengths, so the bytes of distinct objects touched since then is a
+// prefix sum. A request hits an LRU cache of capacity c iff that sum plus its own
+// length is at most c (and its length is unchanged). Positions are renumbered when the
+// tree fills, and keys deeper than the largest capacity are dropped, so memory follows
+// the largest cache rather than the trace.
+class LRUStackDistance : public Cache {
+public:
+    explicit LRUStackDistance(vector<size_t> capacities)
+        : capacities_(std::move(capacities))
+        , hit_count_(capacities_.size() + 1)
+        , hit_length_(capacities_.size() + 1)
+    {
+        resize(1 << 16);
+    }
+
+    void get(uint64_t key, const size_t length, uint64_t) override
+    {
+        request_count_++;
+        request_length_ += length;
+
+        uint32_t n = nodes_.find(key);
+        if (n != kNilNode) {
+            uint32_t pos = positions_[n];
+            size_t old_length = nodes_[n].length;
+            if (old_length == length) {
+                uint64_t distance = total_ - prefix_sum(pos) + length;
+                size_t i = std::lower_bound(capacities_.begin(), capacities_.end(), distance)
+                    - capacities_.begin();
+                hit_count_[i]++;
+                hit_length_[i] += length;
+            }
+            fenwick_add(pos, -(int64_t)old_length);
+            owners_[pos] = kNilNode;
+            nodes_[n].length = length;
+        } else {
+            n = nodes_.insert(key, length);
+            if (positions_.size() <= n) {
+                positions_.resize(n + 1);
+            }
+        }
+
+        if (cursor_ == owners_.size()) {
+            compact();
+        }
+        positions_[n] = cursor_;
+        owners_[cursor_] = n;
+        fenwick_add(cursor_, length);
+        cursor_++;
+
+        // the oldest object is as deep as everything in the tree
+        while (total_ > capacities_.back()) {
+            while (owners_[oldest_] == kNilNode) {
+                oldest_++;
+            }
+            uint32_t victim = owners_[oldest_];
+            fenwick_add(oldest_, -(int64_t)nodes_[victim].length);
+            owners_[oldest_] = kNilNode;
+            nodes_.erase(victim);
+        }
+    }
+
+    size_t size() const { return capacities_.size(); }
+
+    size_t capacity(size_t i) const { return capacities_[i]; }
+
+    uint64_t request_count() const { return request_count_; }
+
+    uint64_t request_length() const { return request_length_; }
+
+    // hits of an LRU cache holding capacity(i) bytes
+    uint64_t hit_count(size_t i) const
+    {
+        uint64_t sum = 0;
+        for (size_t j = 0; j <= i; j++) {
+            sum += hit_count_[j];
+        }
+        return sum;
+    }
+
+    uint64_t hit_length(size_t i) const
+    {
+        uint64_t sum = 0;
+        for (size_t j = 0; j <= i; j++) {
+            sum += hit_length_[j];
+        }
+        return sum;
+    }
+
+private:
+    void fenwick_add(uint32_t pos, int64_t delta)
+    {
+        total_ += delta;
+        for (size_t i = pos + 1; i <= tree_.size(); i += i & -i) {
+            tree_[i - 1] += delta;
+        }
+    }
+
+    // sum of lengths at positions [0, pos]
+    uint64_t prefix_sum(uint32_t pos) const
+    {
+        int64_t sum = 0;
+        for (size_t i = pos + 1; i > 0; i -= i & -i) {
+            sum += tree_[i - 1];
+        }
+        return sum;
+    }
+
+    void resize(size_t size)
+    {
+        tree_.assign(size, 0);
+        owners_.assign(size, kNilNode);
+        total_ = 0;
+        cursor_ = 0;
+        oldest_ = 0;
+    }
+
+    // renumbers live keys to 0..count-1 in access order, doubling the tree if it is
+    // more than half full
+    void compact()
+    {
+        vector<uint32_t> live;
+        live.reserve(nodes_.size());
+        for (size_t pos = oldest_; pos < cursor_; pos++) {
+            if (owners_[pos] != kNilNode) {
+                live.push_back(owners_[pos]);
+            }
+        }
+
+        size_t size = owners_.size();
+        if (live.size() * 2 > size) {
+            size *= 2;
+        }
+        resize(size);
+
+        for (uint32_t n : live) {
+            positions_[n] = cursor_;
+            owners_[cursor_] = n;
+            tree_[cursor_] = nodes_[n].length;
+            total_ += nodes_[n].length;
+            cursor_++;
+        }
+        // linear-time Fenwick build from the raw values
+        for (size_t i = 1; i <= tree_.size(); i++) {
+            size_t parent = i + (i & -i);
+            if (parent <= tree_.size()) {
+                tree_[parent - 1] += tree_[i - 1];
+            }
+        }
+    }
+
+private:
+    vector<size_t> capacities_;
+    // hit_count_[i] counts hits at distance in (capacities_[i-1], capacities_[i]]
+    vector<uint64_t> hit_count_;
+    vector<uint64_t> hit_length_;
+    uint64_t request_count_ = 0;
+    uint64_t request_length_ = 0;
+
+    NodeTable<uint64_t> nodes_;
+    vector<uint32_t> positions_;
+    vector<uint32_t> owners_;
+    vector<int64_t> tree_;
+    uint64_t total_ = 0;
+    size_t cursor_ = 0;
+    size_t oldest_ = 0;
+};
+
+// LRU over objects instead of parts. An object is indexed once and keeps a bitmap of
+// its cached parts, so a range costs one lookup however many parts it spans, and memory
+// grows with the objects rather than the parts. Any access to an object makes all of its
+// parts recent; eviction takes parts from the least recently used object, highest part
+// first. A plain get caches its key as a single part of the request's length.
+class RangeLRUCache : public Cache, public CacheStatImpl {
+public:
+    explicit RangeLRUCache(size_t capacity)
+        : capacity_(capacity)
+    {
+        list_ = nodes_.new_list();
+    }
+
+    void get(uint64_t key, const size_t length, uint64_t) override
+    {
+        access(key, length, true, 0, 0);
+    }
+
+    void get_range(uint64_t object_key, size_t entity_length, uint32_t first, uint32_t last,
+        uint64_t) override
+    {
+        access(object_key, entity_length, false, first, last);
+    }
+
+    Stat get_stat() const override
+    {
+        Stat stat;
+        stat.class_name = string(type_name<RangeLRUCache>());
+        stat.capacity = capacity_;
+        stat.count = nodes_.size();
+        stat.used = used_;
+        fill_stat(stat, snapshot());
+        return stat;
+    }
+
+private:
+    struct Meta {
+        size_t entity_length;
+        bool whole;
+        // bit i is set when part i is cached
+        vector<uint64_t> parts;
+    };
+
+    typedef NodeTable<uint64_t, Meta>::Node Node;
+
+    static size_t part_length(const Node &node, size_t i)
+    {
+        return node.whole ? node.entity_length : part_size(node.entity_length, i);
+    }
+
+    void access(uint64_t key, size_t entity_length, bool whole, uint32_t first, uint32_t last)
+    {
+        uint32_t n = nodes_.find(key);
+        if (n != kNilNode
+            && (nodes_[n].entity_length != entity_length || nodes_[n].whole != whole)) {
+            // the object changed, none of its cached parts are valid
+            drop(n);
+            n = kNilNode;
+        }
+        if (n == kNilNode) {
+            n = nodes_.insert(key, 0);
+            nodes_[n].entity_length = entity_length;
+            nodes_[n].whole = whole;
+        } else {
+            nodes_.unlink(n);
+        }
+        nodes_.push_front(list_, n);
+
+        Node &node = nodes_[n];
+        if (node.parts.size() <= last / 64) {
+            node.parts.resize(last / 64 + 1);
+        }
+
+        // indexed by is_hit
+        uint64_t count[2] = {};
+        size_t length[2] = {};
+        for (uint64_t i = first; i <= last; i++) {
+            uint64_t &word = node.parts[i / 64];
+            const uint64_t bit = 1ULL << (i % 64);
+            const size_t len = part_length(node, i);
+            const bool is_hit = word & bit;
+            count[is_hit]++;
+            length[is_hit] += len;
+            if (!is_hit) {
+                word |= bit;
+                node.length += len;
+                used_ += len;
+            }
+        }
+
+        for (int h = 0; h < 2; h++) {
+            if (count[h] > 0) {
+                on_get_parts(key, count[h], length[h], h);
+            }
+        }
+
+        evict();
+    }
+
+    void evict()
+    {
+        while (used_ > capacity_) {
+            uint32_t n = nodes_.back(list_);
+            Node &node = nodes_[n];
+            while (!node.parts.empty() && node.parts.back() == 0) {
+                node.parts.pop_back();
+            }
+            if (node.parts.empty()) {
+                drop(n);
+                continue;
+            }
+
+            uint64_t &word = node.parts.back();
+            const int bit = 63 - __builtin_clzll(word);
+            const size_t len = part_length(node, (node.parts.size() - 1) * 64 + bit);
+            word &= ~(1ULL << bit);
+            node.length -= len;
+            used_ -= len;
+        }
+    }
+
+    void drop(uint32_t n)
+    {
+        used_ -= nodes_[n].length;
+        vector<uint64_t>().swap(nodes_[n].parts);
+        nodes_.unlink(n);
+        nodes_.erase(n);
+    }
+
+private:
+    NodeTable<uint64_t, Meta> nodes_;
+    uint32_t list_;
+    size_t capacity_;
+    size_t used_ = 0;
+};
+
+struct Policy {
+    const char *name;
+    int *enabled;
+    shared_ptr<Cache> (*create)(size_t capacity);
+};
+
+static Policy g_policies[] = {
+    { "lru", &g_cfg.enable_lru, make_cache<LRUCacheImpl<uint64_t>> },
+    { "fifo", &g_cfg.enable_fifo, make_cache<FIFOCacheImpl<uint64_t>> },
+    { "block", &g_cfg.enable_block, make_cache<BlockCacheImpl<uint64_t>> },
+    { "block_v2", &g_cfg.enable_block_v2, make_cache<BlockCacheImplV2<uint64_t>> },
+    { "tinylfu", &g_cfg.enable_tinylfu, make_cache<TinyLFUCacheImpl<uint64_t>> },
+    { "arc", &g_cfg.enable_arc, make_cache<ARCCacheImpl<uint64_t>> },
+    { "s3fifo", &g_cfg.enable_s3fifo, make_cache<S3FIFOCacheImpl<uint64_t>> },
+    { "lirs", &g_cfg.enable_lirs, make_cache<LIRSCacheImpl<uint64_t>> },
+    { "log", &g_cfg.enable_log, make_cache<LogCacheImpl<uint64_t>> },
+    // keyed by object, so it cannot sit behind the admission stage
+    { "range_lru", &g_cfg.enable_range_lru,
+        [](size_t capacity) -> shared_ptr<Cache> {
+            return make_shared<RangeLRUCache>(capacity);
+        } },
+};
+
+static vector<shared_ptr<Cache>> create_caches(size_t capacity)
+{
+    vector<shared_ptr<Cache>> caches;
+
+    for (const Policy &policy : g_policies) {
+        if (*policy.enabled) {
+            caches.emplace_back(policy.create(capacity));
+        }
+    }
+
+    return caches;
+}
+
+// a miss-ratio curve: LRU through stack distances, every other policy as one instance
+// per capacity
+struct MissRatioCurve {
+    shared_ptr<LRUStackDistance> lru;
+    vector<tuple<const char *, size_t, shared_ptr<Cache>>> points;
+};
+
+static MissRatioCurve create_mrc(
+    const vector<size_t> &capacities, vector<shared_ptr<Cache>> &caches)
+{
+    MissRatioCurve mrc;
+
+    for (const Policy &policy : g_policies) {
+        if (!*policy.enabled) {
+            continue;
+        }
+
+        if (policy.enabled == &g_cfg.enable_lru) {
+            mrc.lru = make_shared<LRUStackDistance>(capacities);
+            caches.emplace_back(mrc.lru);
+            continue;
+        }
+
+        for (size_t capacity : capacities) {
+            auto cache = policy.create(capacity);
+            mrc.points.emplace_back(policy.name, capacity, cache);
+            caches.emplace_back(cache);
+        }
+    }
+
+    return mrc;
+}
+
+static void output_mrc(const MissRatioCurve &mrc, double scale)
+{
+    printf("policy,capacity,requests,hit_ratio,byte_hit_ratio\n");
+
+    if (mrc.lru) {
+        const LRUStackDistance &lru = *mrc.lru;
+        for (size_t i = 0; i < lru.size(); i++) {
+            printf("lru,%lu,%lu,%.6f,%.6f\n", (size_t)(lru.capacity(i) / scale),
+                lru.request_count(), (double)lru.hit_count(i) / lru.request_count(),
+                (double)lru.hit_length(i) / lru.request_length());
+        }
+    }
+
+    for (const auto &point : mrc.points) {
+        auto st = std::dynamic_pointer_cast<CacheStat>(std::get<2>(point))->get_stat();
+        long count = st.hit_count + st.miss_count;
+        long length = st.hit_length + st.miss_length;
+        printf("%s,%lu,%ld,%.6f,%.6f\n", std::get<0>(point), (size_t)(std::get<1>(point) / scale),
+            count, (double)st.hit_count / count, (double)st.hit_length / length);
+    }
+}
+
+static vector<shared_ptr<Cache>> g_caches;
+static unique_ptr<Pipeline> g_pipeline;
+
+// SHARDS-style spatial sampling: a key is replayed only if its hash falls under the
+// threshold, so a sampled key keeps all of its requests and the caches, scaled down by
+// the same rate, see the reuse pattern of the full trace in miniature.
+static const uint64_t kSampleModulus = 1 << 24;
+static uint64_t g_sample_threshold = kSampleModulus;
+
+// with --clock ts the caches see the trace timestamps as time, otherwise the number of
+// requests replayed so far
+static bool g_clock_ts = false;
+
+static void cache_get(const Request &req)
+{
+    if ((mix64(req.key) & (kSampleModulus - 1)) >= g_sample_threshold) {
+        return;
+    }
+
+    g_current_ticks++;
+    const uint64_t now = g_clock_ts ? req.ts : g_current_ticks;
+
+    if (g_pipeline) {
+        g_pipeline->push(Request { req.key, req.length, now });
+        return;
+    }
+
+    for (const auto &cache : g_caches) {
+        cache->get(req.key, req.length, now);
+    }
+}
+
+// now is the time of part first. Each later part is a tick after the one before, as in
+// the replay one part at a time, unless they all carry the trace's timestamp.
+void Cache::get_range(
+    uint64_t object_key, size_t entity_length, uint32_t first, uint32_t last, uint64_t now)
+{
+    const uint64_t tick = g_clock_ts ? 0 : 1;
+    for (uint64_t i = first; i <= last; i++) {
+        get(part_fingerprint(object_key, i), part_size(entity_length, i), now + (i - first) * tick);
+    }
+}
+
+// A slice counts as one request per part on the clock, and is sampled by object. Only
+// the serial replay takes slices, main turns --range down with --pipeline.
+static void cache_get(const RangeRequest &req)
+{
+    if (req.first > req.last || (mix64(req.key) & (kSampleModulus - 1)) >= g_sample_threshold) {
+        return;
+    }
+
+    const uint64_t now = g_clock_ts ? req.ts : g_current_ticks + 1;
+    g_current_ticks += req.last - req.first + 1;
+
+    for (const auto &cache : g_caches) {
+        cache->get_range(req.key, req.entity_length, req.first, req.last, now);
+    }
+}
+
+// Splits str on sep without copying, skipping empty tokens. Returns the number of tokens,
+// which is max_tokens + 1 if there are more than fit.
+static size_t split_tokens(string_view str, char sep, string_view *tokens, size_t max_tokens)
+{
+    size_t n = 0;
+    size_t pos = 0;
+
+    while (pos < str.length()) {
+        size_t next = str.find(sep, pos);
+        if (next == string_view::npos) {
+            next = str.length();
+        }
+        if (next > pos) {
+            if (n == max_tokens) {
+                return n + 1;
+            }
+            tokens[n++] = str.substr(pos, next - pos);
+        }
+        pos = next + 1;
+    }
+
+    return n;
+}
+
+// leading decimal digits of str, like atol()
+static long parse_long(string_view str)
+{
+    long n = 0;
+    for (char c : str) {
+        if (c < '0' || c > '9') {
+            break;
+        }
+        n = n * 10 + (c - '0');
+    }
+    return n;
+}
+
+// key len [ts]
+template <typename Sink> static void parse_line(string_view line, Sink &&sink)
+{
+    string_view tokens[3];
+    size_t ntokens = split_tokens(line, ' ', tokens, 3);
+    if (ntokens != 2 && ntokens != 3) {
+        log_info("line %.*s is invalid", (int)line.length(), line.data());
+        return;
+    }
+
+    const string_view keystr = tokens[0];
+    const string_view lenstr = tokens[1];
+    const uint64_t key = key_fingerprint(keystr.data(), keystr.length());
+    const long len = parse_long(lenstr);
+    const uint64_t ts = ntokens == 3 ? parse_long(tokens[2]) : 0;
+
+    sink(Request { key, (uint64_t)len, ts });
+}
+
+// ranges hkey entity_len name [ts], every start-end slice goes to sink as a RangeRequest
+template <typename Sink> static void parse_ranges_v2(string_view line, Sink &&sink)
+{
+    string_view tokens[5];
+    size_t ntokens = split_tokens(line, ' ', tokens, 5);
+    if (ntokens != 4 && ntokens != 5) {
+        log_info("line %.*s is invalid", (int)line.length(), line.data());
+        return;
+    }
+
+    const string_view items = tokens[0];
+    const string_view hkey = tokens[1];
+    const string_view entity_lenstr = tokens[2];
+    const string_view name = tokens[3];
+    const long entity_length = parse_long(entity_lenstr);
+    const uint64_t ts = ntokens == 5 ? parse_long(tokens[4]) : 0;
+    const uint64_t object_key
+        = key_fingerprint(name.data(), name.length(), key_fingerprint(hkey.data(), hkey.length()));
+
+    for (size_t pos = 0; pos < items.length();) {
+        size_t next = items.find(',', pos);
+        if (next == string_view::npos) {
+            next = items.length();
+        }
+        const string_view slice = items.substr(pos, next - pos);
+        pos = next + 1;
+        if (slice.empty()) {
+            continue;
+        }
 
-        b->n = nullptr;
-        if (block_map_.find(b->key) == block_map_.end()) {
-            block_map_[b->key] = b;
-        } else {
-            b->n = block_map_[b->key];
-            block_map_[b->key] = b;
+        string_view start_ends[2];
+        if (split_tokens(slice, '-', start_ends, 2) != 2) {
+            log_info("start and end %.*s is invalid", (int)slice.length(), slice.data());
+            continue;
+        }
+
+        // parts past the object's end, or past what a uint32_t counts, are a broken trace
+        const long start = parse_long(start_ends[0]);
+        const long end = parse_long(start_ends[1]);
+        if (start > end || entity_length <= 0 || end > (entity_length - 1) >> 20
+            || end > (long)UINT32_MAX) {
+            log_info("start and end %.*s is invalid", (int)slice.length(), slice.data());
+            continue;
         }
+        sink(RangeRequest {
+            object_key, (uint64_t)entity_length, (uint32_t)start, (uint32_t)end, ts });
     }
+}
 
-    void block_remove(BlockImpl *b)
-    {
-        b->prev->next = b->next;
-        b->next->prev = b->prev;
+// the same, one request per part
+template <typename Sink> static void parse_line_v2(string_view line, Sink &&sink)
+{
+    parse_ranges_v2(line, [&sink](const RangeRequest &range) {
+        for (uint64_t i = range.first; i <= range.last; i++) {
+            const uint64_t key = part_fingerprint(range.key, i);
+            const long len = part_size(range.entity_length, i);
+            sink(Request { key, (uint64_t)len, range.ts });
+        }
+    });
+}
 
-        assert(block_map_.find(b->key) != block_map_.end());
-        BlockImpl *p = block_map_[b->key];
-        for (BlockImpl *prev = nullptr; p; prev = p, p = p->n) {
-            if (p != b) {
-                continue;
-            }
-            if (p->n) {
-                if (prev) {
-                    prev->n = p->n;
-                } else {
-                    block_map_[b->key] = p->n;
-                }
-            } else {
-                if (prev) {
-                    prev->n = nullptr;
-                } else {
-                    block_map_.erase(b->key);
-                }
-            }
+template <typename Sink> static void parse_trace_line(string_view line, Sink &&sink)
+{
+    if (!g_cfg.is_v2) {
+        parse_line(line, sink);
+        return;
+    }
+
+    // sinks that take slices get them whole with --range, the others one part at a time
+    if constexpr (std::is_invocable_v<Sink, const RangeRequest &>) {
+        if (g_cfg.range) {
+            parse_ranges_v2(line, sink);
+            return;
         }
     }
+    parse_line_v2(line, sink);
+}
 
-    void drop_cache(CacheImpl *c)
-    {
-        vmap_.erase(c->key);
-        size_ -= c->length;
-        delete c;
+template <typename Sink> static void parse_lines(const char *p, const char *end, Sink &&sink)
+{
+    while (p < end) {
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        const char *eol = nl ? nl : end;
+        parse_trace_line(string_view(p, eol - p), sink);
+        p = eol + 1;
     }
+}
 
-    void drop_block(BlockImpl *b)
-    {
-        while (1) {
-            CacheImpl *c = b->first;
-            if (c == nullptr) {
-                break;
-            }
+// Binary trace: a 16-byte file header followed by blocks of at most kTraceBlockRecords
+// records. A block is a 12-byte header (record count, flags, payload bytes) and the
+// records: the 8-byte key fingerprint, the length as a varint and, if the block has
+// timestamps, the zigzag varint delta from the previous timestamp of the block.
+// Integers are stored in host (little endian) byte order.
+static const char kTraceMagic[8] = { 'C', 'S', 'T', 'R', 'A', 'C', 'E', '1' };
+static const uint32_t kTraceVersion = 1;
+static const uint32_t kTraceHasTimestamp = 1;
+static const size_t kTraceBlockRecords = 65536;
+
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
 
-            b->first = c->next;
-            drop_cache(c);
-        }
+struct TraceBlockHeader {
+    uint32_t count;
+    uint32_t flags;
+    uint32_t payload_size;
+};
 
-        delete b;
+static bool is_binary_trace(const char *data, size_t size)
+{
+    return size >= sizeof(TraceFileHeader) && !memcmp(data, kTraceMagic, sizeof(kTraceMagic));
+}
+
+// a binary trace holds one key per part, the slices and objects of --range are gone
+static void check_binary_trace_options()
+{
+    if (g_cfg.range && g_cfg.is_v2 && str_empty(g_cfg.convert)) {
+        log_fatal("--range needs a text v2 trace, a binary trace holds one key per part");
     }
+}
 
-private:
-    BlockImpl *wblock_;
-    size_t size_;
-    size_t capacity_;
-    BlockImpl head_;
-    BlockImpl tail_;
-    map<uint64_t, BlockImpl *> block_map_;
-    unordered_map<Key, CacheImpl *> vmap_;
-};
+static char *put_varint(char *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char)v;
+    return p;
+}
 
-static uint64_t g_current_ticks = 0;
+static const char *get_varint(const char *p, const char *end, uint64_t *v)
+{
+    uint64_t n = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        n |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = n;
+            return p;
+        }
+    }
+    return nullptr;
+}
 
-class CacheStatImpl : public CacheStat {
+class TraceWriter {
 public:
-    void on_get(const string &key, const size_t length, bool is_hit) override
+    explicit TraceWriter(const char *path)
     {
-        log_debug("get key %s, length %d, result %s", key.data(), length, is_hit ? "HIT" : "MISS");
-
-        if (is_hit) {
-            hit_count_++;
-            hit_length_ += length;
-        } else {
-            miss_count_++;
-            miss_length_ += length;
+        fp_ = fopen(path, "wb");
+        if (fp_ == nullptr) {
+            log_fatal("open %s failed: %s", path, strerror(errno));
         }
 
-        interval_log_if_need();
+        TraceFileHeader hdr;
+        memcpy(hdr.magic, kTraceMagic, sizeof(hdr.magic));
+        hdr.version = kTraceVersion;
+        hdr.reserved = 0;
+        write(&hdr, sizeof(hdr));
+
+        block_.reserve(kTraceBlockRecords);
+        // worst case per record: key, 10-byte length, 10-byte timestamp delta
+        payload_.resize(kTraceBlockRecords * (sizeof(uint64_t) + 20));
     }
 
-private:
-    void interval_log_if_need()
+    ~TraceWriter() { finish(); }
+
+    void append(const Request &req)
     {
-        if (g_current_ticks % g_cfg.interval == 0 && g_current_ticks > 0) {
-            interval_log();
+        block_.push_back(req);
+        if (block_.size() == kTraceBlockRecords) {
+            flush_block();
         }
     }
 
-    void interval_log()
+    void finish()
     {
-        long hit_c = hit_count_ - last_hit_count_;
-        long miss_c = miss_count_ - last_miss_count_;
-        long hit_l = hit_length_ - last_hit_length_;
-        long miss_l = miss_length_ - last_miss_length_;
-
-        Stat st = get_stat();
-        log_info("%s: hit_count = %ld, miss_count = %ld, rate is %0.02f%%", st.class_name.data(),
-            hit_c, miss_c, (double)hit_c / (hit_c + miss_c) * 100);
-        log_info("%s: hit_length = %s, miss_length = %s, rate is %0.02f%%", st.class_name.data(),
-            get_size_str(hit_l).data(), get_size_str(miss_l).data(),
-            (double)hit_l / (hit_l + miss_l) * 100);
+        if (fp_ == nullptr) {
+            return;
+        }
 
-        log_info("%s: count = %ld, in use %s/%s", st.class_name.data(), st.count,
-            get_size_str(st.used).data(), get_size_str(st.capacity).data());
+        flush_block();
+        fclose(fp_);
+        fp_ = nullptr;
 
-        last_hit_count_ = hit_count_;
-        last_miss_count_ = miss_count_;
-        last_hit_length_ = hit_length_;
-        last_miss_length_ = miss_length_;
+        log_info("wrote %lu records in %s, %.02f bytes/record", records_,
+            get_size_str(bytes_).data(), records_ ? (double)bytes_ / records_ : 0.0);
     }
 
-protected:
-    long hit_count_ = 0;
-    long miss_count_ = 0;
-    long hit_length_ = 0;
-    long miss_length_ = 0;
-    long last_hit_count_ = 0;
-    long last_miss_count_ = 0;
-    long last_hit_length_ = 0;
-    long last_miss_length_ = 0;
-};
-
-template <typename Impl> class TCache : public Cache, public CacheStatImpl {
-public:
-    TCache(size_t cap)
-        : impl_(cap)
+private:
+    void flush_block()
     {
-    }
+        if (block_.empty()) {
+            return;
+        }
 
-    void get(const string &key, const size_t length) override
-    {
-        auto [is_hit, old_length] = impl_.get(key);
-        if (!is_hit || old_length != length) {
-            is_hit = false;
-            impl_.set(key, length);
+        TraceBlockHeader hdr;
+        hdr.count = block_.size();
+        hdr.flags = 0;
+        for (const Request &req : block_) {
+            if (req.ts != 0) {
+                hdr.flags |= kTraceHasTimestamp;
+                break;
+            }
         }
-        on_get(key, length, is_hit);
+
+        char *p = payload_.data();
+        uint64_t last_ts = 0;
+        for (const Request &req : block_) {
+            memcpy(p, &req.key, sizeof(req.key));
+            p += sizeof(req.key);
+            p = put_varint(p, req.length);
+            if (hdr.flags & kTraceHasTimestamp) {
+                int64_t delta = (int64_t)(req.ts - last_ts);
+                p = put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+                last_ts = req.ts;
+            }
+        }
+        hdr.payload_size = p - payload_.data();
+
+        write(&hdr, sizeof(hdr));
+        write(payload_.data(), hdr.payload_size);
+
+        records_ += block_.size();
+        block_.clear();
     }
 
-    Stat get_stat() const override
+    void write(const void *data, size_t n)
     {
-        Stat stat;
-        stat.class_name = get_filt_type_name<decltype(*this)>();
-        stat.capacity = impl_.capacity();
-        stat.count = impl_.count();
-        stat.used = impl_.used();
-        return stat;
+        if (fwrite(data, 1, n, fp_) != n) {
+            log_fatal("write trace failed: %s", strerror(errno));
+        }
+        bytes_ += n;
     }
 
 private:
-    Impl impl_;
+    FILE *fp_;
+    vector<Request> block_;
+    vector<char> payload_;
+    uint64_t records_ = 0;
+    uint64_t bytes_ = 0;
 };
 
-using LRUCache = TCache<LRUCacheImpl<string>>;
-using FIFOCache = TCache<FIFOCacheImpl<string>>;
-using BlockCache = TCache<BlockCacheImpl<string>>;
-using BlockCacheV2 = TCache<BlockCacheImplV2<string>>;
-
-vector<string> split(const string &str, const string &delim)
+template <typename Sink>
+static bool decode_trace_block(const TraceBlockHeader &hdr, const char *p, Sink &&sink)
 {
-    vector<string> tokens;
-    size_t prev = 0, pos = 0;
-    do {
-        pos = str.find(delim, prev);
-        if (pos == string::npos)
-            pos = str.length();
-        string token = str.substr(prev, pos - prev);
-        if (!token.empty())
-            tokens.push_back(token);
-        prev = pos + delim.length();
-    } while (pos < str.length() && prev < str.length());
-    return tokens;
+    const char *end = p + hdr.payload_size;
+    uint64_t ts = 0;
+
+    for (uint32_t i = 0; i < hdr.count; i++) {
+        Request req;
+        if (end - p < (long)sizeof(req.key)) {
+            return false;
+        }
+        memcpy(&req.key, p, sizeof(req.key));
+        p += sizeof(req.key);
+
+        p = get_varint(p, end, &req.length);
+        if (p == nullptr) {
+            return false;
+        }
+
+        if (hdr.flags & kTraceHasTimestamp) {
+            uint64_t zz;
+            p = get_varint(p, end, &zz);
+            if (p == nullptr) {
+                return false;
+            }
+            ts += (uint64_t)((int64_t)(zz >> 1) ^ -(int64_t)(zz & 1));
+        }
+        req.ts = ts;
+
+        sink(req);
+    }
+
+    return true;
 }
 
-LRUCache *g_lru_cache = nullptr;
-FIFOCache *g_fifo_cache = nullptr;
-BlockCache *g_block_cache = nullptr;
-BlockCacheV2 *g_block_cache_v2 = nullptr;
+template <typename Sink> static void decode_trace(const char *data, size_t size, Sink &&sink)
+{
+    const char *p = data + sizeof(TraceFileHeader);
+    const char *end = data + size;
+
+    while (p < end) {
+        TraceBlockHeader hdr;
+        if ((size_t)(end - p) < sizeof(hdr)) {
+            log_error("truncated block header at offset %ld", p - data);
+            return;
+        }
+        memcpy(&hdr, p, sizeof(hdr));
+        p += sizeof(hdr);
+
+        if ((size_t)(end - p) < hdr.payload_size || !decode_trace_block(hdr, p, sink)) {
+            log_error("corrupted block at offset %ld", p - data);
+            return;
+        }
+        p += hdr.payload_size;
+    }
+}
 
-static void cache_get(const string &key, const long len)
+// Parses the mapped trace in windows of parse_threads chunks, one thread per chunk. The
+// next window is parsed while the requests of the current one are replayed in order.
+// Request buffers are reused across windows, so steady state does no allocation.
+template <typename Sink>
+static void parse_lines_parallel(const char *data, size_t size, int nthreads, Sink &&sink)
 {
-    g_current_ticks++;
+    static constexpr size_t kChunkSize = 16 << 20;
+
+    struct Window {
+        vector<vector<Request>> parsed;
+        vector<std::thread> threads;
+    };
+
+    const char *p = data;
+    const char *end = data + size;
+
+    auto start_window = [&](Window &w) {
+        w.parsed.resize(nthreads);
+        for (int i = 0; i < nthreads && p < end; i++) {
+            const char *chunk_end = end;
+            if ((size_t)(end - p) > kChunkSize) {
+                const char *nl = (const char *)memchr(p + kChunkSize, '\n', end - p - kChunkSize);
+                chunk_end = nl ? nl + 1 : end;
+            }
+
+            vector<Request> *out = &w.parsed[i];
+            w.threads.emplace_back([out, p, chunk_end] {
+                out->clear();
+                parse_lines(p, chunk_end, [out](const Request &req) { out->push_back(req); });
+            });
+            p = chunk_end;
+        }
+    };
+
+    Window windows[2];
+    int cur = 0;
+    start_window(windows[cur]);
+
+    while (!windows[cur].threads.empty()) {
+        for (auto &t : windows[cur].threads) {
+            t.join();
+        }
+        size_t nchunks = windows[cur].threads.size();
+        windows[cur].threads.clear();
+
+        start_window(windows[cur ^ 1]);
+
+        for (size_t i = 0; i < nchunks; i++) {
+            for (const Request &req : windows[cur].parsed[i]) {
+                sink(req);
+            }
+        }
+        cur ^= 1;
+    }
+}
 
-    if (g_cfg.enable_lru) {
-        g_lru_cache->get(key, len);
+template <typename Sink> static void read_trace_file(const char *path, Sink &&sink)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_fatal("open %s failed: %s", path, strerror(errno));
     }
 
-    if (g_cfg.enable_fifo) {
-        g_fifo_cache->get(key, len);
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        log_fatal("stat %s failed: %s", path, strerror(errno));
     }
 
-    if (g_cfg.enable_block) {
-        g_block_cache->get(key, len);
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return;
     }
 
-    if (g_cfg.enable_block_v2) {
-        g_block_cache_v2->get(key, len);
+    const char *data = (const char *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        log_fatal("mmap %s failed: %s", path, strerror(errno));
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    if (is_binary_trace(data, size)) {
+        check_binary_trace_options();
+        decode_trace(data, size, sink);
+    } else if (g_cfg.parse_threads > 1) {
+        parse_lines_parallel(data, size, g_cfg.parse_threads, sink);
+    } else {
+        parse_lines(data, data + size, sink);
     }
+
+    munmap((void *)data, size);
+    close(fd);
 }
 
-static void process_line(const string &line)
+// Streams stdin through a reused buffer, so pipes (e.g. from a decompressor) work for
+// both text and binary traces.
+template <typename Sink> static void read_trace_stdin(Sink &&sink)
 {
-    const auto tokens = split(line, " ");
-    if (tokens.size() != 2) {
-        log_info("line %s is invalid", line.data());
+    vector<char> buf(1 << 20);
+    size_t begin = 0;
+    size_t end = 0;
+    bool eof = false;
+
+    // makes at least n bytes available unless stdin ends first
+    auto fill = [&](size_t n) {
+        if (begin > 0 && begin + n > buf.size()) {
+            memmove(buf.data(), buf.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (begin + n > buf.size()) {
+            buf.resize(begin + n);
+        }
+        while (!eof && end - begin < n) {
+            ssize_t nr = read(STDIN_FILENO, buf.data() + end, buf.size() - end);
+            if (nr < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nr < 0) {
+                log_fatal("read stdin failed: %s", strerror(errno));
+            }
+            if (nr == 0) {
+                eof = true;
+            }
+            end += nr;
+        }
+        return end - begin;
+    };
+
+    if (fill(sizeof(TraceFileHeader)) >= sizeof(TraceFileHeader)
+        && is_binary_trace(buf.data() + begin, end - begin)) {
+        check_binary_trace_options();
+        begin += sizeof(TraceFileHeader);
+        for (;;) {
+            TraceBlockHeader hdr;
+            size_t avail = fill(sizeof(hdr));
+            if (avail == 0) {
+                break;
+            }
+            if (avail < sizeof(hdr)) {
+                log_error("truncated block header");
+                break;
+            }
+            memcpy(&hdr, buf.data() + begin, sizeof(hdr));
+            if (fill(sizeof(hdr) + hdr.payload_size) < sizeof(hdr) + hdr.payload_size
+                || !decode_trace_block(hdr, buf.data() + begin + sizeof(hdr), sink)) {
+                log_error("corrupted block");
+                break;
+            }
+            begin += sizeof(hdr) + hdr.payload_size;
+        }
         return;
     }
 
-    const string &key = tokens[0];
-    const string &lenstr = tokens[1];
-    const long len = std::atol(lenstr.data());
+    for (;;) {
+        // at least one more byte than buffered, so a partial line keeps growing the buffer
+        size_t avail = fill(std::max(end - begin + 1, buf.size() / 2));
+        if (avail == 0) {
+            break;
+        }
+
+        const char *data = buf.data() + begin;
+        const char *last_nl = (const char *)memrchr(data, '\n', avail);
+        size_t n = last_nl ? last_nl - data + 1 : (eof ? avail : 0);
+        if (n == 0) {
+            continue;
+        }
 
-    cache_get(key, len);
+        parse_lines(data, data + n, sink);
+        begin += n;
+    }
 }
 
-static size_t part_size(size_t entity_length, size_t part_index)
+// the class name a cache's section is filed under, empty for the caches that keep no
+// state, the LRU stack distance of --mrc
+static string state_name(const shared_ptr<Cache> &cache)
 {
-    if ((part_index + 1) * 1048576 <= entity_length) {
-        return 1048576;
+    auto stat = std::dynamic_pointer_cast<CacheStat>(cache);
+    return stat ? stat->get_stat().class_name : "";
+}
+
+static void save_states(const char *path, const vector<shared_ptr<Cache>> &caches)
+{
+    struct timeval tv_start = tv_now();
+    FILE *fp = fopen(path, "wb");
+    if (fp == nullptr) {
+        log_fatal("open %s failed: %s", path, strerror(errno));
     }
-    if (part_index * 1048576 > entity_length) {
-        return 1048576;
+    vector<char> buf(1 << 20);
+    setvbuf(fp, buf.data(), _IOFBF, buf.size());
+
+    StateWriter w(fp);
+    StateFileHeader hdr;
+    memcpy(hdr.magic, kStateMagic, sizeof(hdr.magic));
+    hdr.version = kStateVersion;
+    hdr.count = 0;
+    hdr.ticks = g_current_ticks;
+    w.put(hdr);
+
+    for (const auto &cache : caches) {
+        string name = state_name(cache);
+        if (name.empty()) {
+            continue;
+        }
+        long section = ftell(fp);
+        StateSectionHeader sh = { (uint32_t)name.length(), 0, 0 };
+        w.put(sh);
+        w.write(name.data(), name.length());
+
+        size_t start = w.bytes();
+        if (!cache->save_state(w)) {
+            log_info("%s: saving state is not supported", name.data());
+            fseek(fp, section, SEEK_SET);
+            continue;
+        }
+        sh.payload_size = w.bytes() - start;
+        hdr.count++;
+
+        // fill in the size now that the payload is written
+        long end = ftell(fp);
+        fseek(fp, section, SEEK_SET);
+        fwrite(&sh, sizeof(sh), 1, fp);
+        fseek(fp, end, SEEK_SET);
     }
-    return entity_length - part_index * 1048576;
+
+    long end = ftell(fp);
+    rewind(fp);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    if (fflush(fp) != 0 || ftruncate(fileno(fp), end) != 0) {
+        log_fatal("write state %s failed: %s", path, strerror(errno));
+    }
+    fclose(fp);
+
+    log_info("saved %u caches in %s to %s, taken %.02fms", hdr.count, get_size_str(end).data(),
+        path, tv_sub_msec_double(tv_now(), tv_start));
+}
+
+static void load_states(const char *path, const vector<shared_ptr<Cache>> &caches)
+{
+    struct timeval tv_start = tv_now();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_fatal("open %s failed: %s", path, strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        log_fatal("stat %s failed: %s", path, strerror(errno));
+    }
+
+    size_t size = st.st_size;
+    const char *data = (const char *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        log_fatal("mmap %s failed: %s", path, strerror(errno));
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    StateReader r(data, size);
+    auto hdr = r.get<StateFileHeader>();
+    if (memcmp(hdr.magic, kStateMagic, sizeof(hdr.magic)) != 0 || hdr.version != kStateVersion) {
+        log_fatal("%s is not a cache state file", path);
+    }
+    g_current_ticks = hdr.ticks;
+
+    // one section per cache: a section restores the first cache of its class name not
+    // restored yet, so that the caches of --mrc, which share a name, get theirs in order
+    vector<bool> restored(caches.size(), false);
+    for (uint32_t i = 0; i < hdr.count; i++) {
+        auto sh = r.get<StateSectionHeader>();
+        string_view name(r.read(sh.name_length), sh.name_length);
+        StateReader payload(r.read(sh.payload_size), sh.payload_size);
+
+        size_t c = 0;
+        for (; c < caches.size(); c++) {
+            if (!restored[c] && state_name(caches[c]) == name) {
+                break;
+            }
+        }
+        if (c == caches.size()) {
+            log_error("%.*s: no cache left for this state in %s, skipped", (int)name.size(),
+                name.data(), path);
+            continue;
+        }
+
+        restored[c] = true;
+        if (!caches[c]->load_state(payload) || !payload.done()) {
+            log_fatal("%.*s: bad state in %s", (int)name.size(), name.data(), path);
+        }
+        auto stat = std::dynamic_pointer_cast<CacheStat>(caches[c])->get_stat();
+        log_info("%s: restored count = %ld, in use %s/%s", stat.class_name.data(), stat.count,
+            get_size_str(stat.used).data(), get_size_str(stat.capacity).data());
+    }
+    for (size_t c = 0; c < caches.size(); c++) {
+        if (!restored[c] && !state_name(caches[c]).empty()) {
+            log_error("%s: no state for it in %s, starts cold", state_name(caches[c]).data(),
+                path);
+        }
+    }
+
+    munmap((void *)data, size);
+    close(fd);
+
+    log_info("loaded %s, taken %.02fms", path, tv_sub_msec_double(tv_now(), tv_start));
 }
 
-static void process_line_v2(const string &line)
+static void run_bench()
 {
-    const auto tokens = split(line, " ");
-    if (tokens.size() != 4) {
-        log_info("line %s is invalid", line.data());
+    // synthetic skewed trace, generated up front so only the replay is timed
+    const long nkeys = 1 << 20;
+    std::default_random_engine e;
+    std::uniform_real_distribution<double> u(0, 1);
+    vector<Request> reqs;
+    reqs.reserve(g_cfg.bench);
+    for (int i = 0; i < g_cfg.bench; i++) {
+        long id = (long)std::pow(nkeys, u(e)) - 1;
+        long len = 1024 + (id * 2654435761L) % 1048576;
+        string key = "key_" + std::to_string(id);
+        reqs.push_back(
+            { key_fingerprint(key.data(), key.length()), (uint64_t)len, (uint64_t)i + 1 });
+    }
+
+    vector<shared_ptr<Cache>> caches = create_caches(g_cfg.capacity);
+
+    if (g_cfg.pipeline) {
+        struct timeval tv_start = tv_now();
+        Pipeline pipeline(caches);
+        for (const auto &req : reqs) {
+            pipeline.push(req);
+        }
+        pipeline.finish();
+        double ms_taken = tv_sub_msec_double(tv_now(), tv_start);
+        g_reporter.flush();
+
+        log_info("pipeline of %lu caches: %lu requests taken %.02fms, %.0f req/s", caches.size(),
+            reqs.size(), ms_taken, reqs.size() * 1000 / ms_taken);
         return;
     }
 
-    const string &items = tokens[0];
-    const string &hkey = tokens[1];
-    const string &entity_lenstr = tokens[2];
-    const string &name = tokens[3];
-    const long entity_length = atol(entity_lenstr.data());
+    struct timeval tv_total = tv_now();
+    for (auto &cache : caches) {
+        struct timeval tv_start = tv_now();
+        for (const auto &req : reqs) {
+            cache->get(req.key, req.length, req.ts);
+        }
+        double ms_taken = tv_sub_msec_double(tv_now(), tv_start);
+        g_reporter.flush();
+
+        auto stat = std::dynamic_pointer_cast<CacheStat>(cache)->get_stat();
+        log_info("%s: %lu requests taken %.02fms, %.0f req/s", stat.class_name.data(), reqs.size(),
+            ms_taken, reqs.size() * 1000 / ms_taken);
+    }
+    double ms_taken = tv_sub_msec_double(tv_now(), tv_total);
+    log_info("%lu caches in turn: %lu requests taken %.02fms, %.0f req/s", caches.size(),
+        reqs.size(), ms_taken, reqs.size() * 1000 / ms_taken);
+}
+
+// get/set throughput of BlockCacheImplV2 alone, with one 64MB object per block so the
+// number of blocks is known
+static void run_block_bench()
+{
+    const size_t kObjectLength = 64 * 1048576;
+    const int kRequests = 2000000;
 
-    for (const auto &slice : split(items, ",")) {
-        const auto start_ends = split(slice, "-");
-        if (start_ends.size() != 2) {
-            log_info("start and end %s is invalid", slice.data());
+    for (size_t nblocks : { 10000, 1000000 }) {
+        BlockCacheImplV2<uint64_t> cache(nblocks * kObjectLength);
+        for (uint64_t key = 0; key < nblocks; key++) {
+            cache.set(key, kObjectLength);
         }
 
-        const int start = atoi(start_ends[0].data());
-        const int end = atoi(start_ends[1].data());
+        std::default_random_engine e;
+        std::uniform_int_distribution<uint64_t> d(0, nblocks * 2);
+        vector<uint64_t> keys(kRequests);
+        for (auto &key : keys) {
+            key = d(e);
+        }
 
-        for (int i = start; i <= end; i++) {
-            string key = hkey + name + ":" + std::to_string(i);
-            const long len = part_size(entity_length, i);
-            cache_get(key, len);
+        struct timeval tv_start = tv_now();
+        long hits = 0;
+        uint64_t now = 0;
+        for (uint64_t key : keys) {
+            cache.set_clock(++now);
+            if (std::get<0>(cache.get(key))) {
+                hits++;
+            } else {
+                cache.set(key, kObjectLength);
+            }
         }
+        double ms_taken = tv_sub_msec_double(tv_now(), tv_start);
+
+        log_info("BlockCacheImplV2: blocks = %lu, %d requests (%ld hits) taken %.02fms, %.0f req/s",
+            nblocks, kRequests, hits, ms_taken, kRequests * 1000 / ms_taken);
     }
 }
 
@@ -805,7 +3803,52 @@ static command_t cmds[] = { { "c", "cap", cmd_set_size, offsetof(config, capacit
     { "", "lru", cmd_set_bool, offsetof(config, enable_lru), "on" },
     { "", "block", cmd_set_bool, offsetof(config, enable_block), "on" },
     { "", "block_v2", cmd_set_bool, offsetof(config, enable_block_v2), "on" },
-    { "", "v2", nullptr, offsetof(config, is_v2), nullptr, "" } };
+    { "", "tinylfu", cmd_set_bool, offsetof(config, enable_tinylfu), "off",
+        "W-TinyLFU: LRU window, frequency-sketch admission, SLRU main" },
+    { "", "arc", cmd_set_bool, offsetof(config, enable_arc), "off",
+        "ARC weighted by bytes" },
+    { "", "s3fifo", cmd_set_bool, offsetof(config, enable_s3fifo), "off",
+        "S3-FIFO: small, main and ghost FIFOs" },
+    { "", "lirs", cmd_set_bool, offsetof(config, enable_lirs), "off",
+        "LIRS weighted by bytes" },
+    { "", "log", cmd_set_bool, offsetof(config, enable_log), "off",
+        "log-structured flash cache in --block_size segments, reports write amplification; "
+        "the capacity, after --sample_rate scaling, must hold two segments" },
+    { "", "block_size", cmd_set_size, offsetof(config, block_size), "64M",
+        "block size of block and block_v2, segment size of log" },
+    { "", "log_gc", cmd_set_str, offsetof(config, log_gc), "utilization",
+        "segment the log collects: utilization (least live bytes) or fifo (oldest)" },
+    { "", "admission", cmd_set_int, offsetof(config, admission), "0",
+        "cache a missed object only once a count-min sketch has seen it N times, 0 admits all" },
+    { "", "range_lru", cmd_set_bool, offsetof(config, enable_range_lru), "off",
+        "LRU keyed by object with a bitmap of its cached 1MB parts, needs --range with --v2" },
+    { "", "v2", nullptr, offsetof(config, is_v2), nullptr, "" },
+    { "", "range", cmd_set_bool, offsetof(config, range), "off",
+        "with --v2, hand each start-end slice to the caches as one request instead of one "
+        "per part; text traces only, not with --pipeline or --parse_threads" },
+    { "", "bench", cmd_set_int, offsetof(config, bench), "0",
+        "replay N synthetic requests through each enabled policy and report req/s" },
+    { "", "pipeline", cmd_set_bool, offsetof(config, pipeline), "off",
+        "run every policy on its own thread, fed through SPSC rings" },
+    { "", "trace", cmd_set_str, offsetof(config, trace), nullptr,
+        "mmap and replay this trace file instead of reading stdin" },
+    { "", "parse_threads", cmd_set_int, offsetof(config, parse_threads), "1",
+        "parse --trace in chunks on this many threads" },
+    { "", "convert", cmd_set_str, offsetof(config, convert), nullptr,
+        "write the input trace (v1, or v2 with --v2) to this file in binary format and exit" },
+    { "", "sample_rate", cmd_set_double, offsetof(config, sample_rate), "1",
+        "replay only this fraction of the keys against caches scaled down by it" },
+    { "", "mrc", cmd_set_str, offsetof(config, mrc), nullptr,
+        "comma separated capacities, output a CSV miss-ratio curve over all of them" },
+    { "", "bench_blocks", cmd_set_bool, offsetof(config, bench_blocks), "off",
+        "benchmark BlockCacheImplV2 get/set at 10K and 1M blocks" },
+    { "", "clock", cmd_set_str, offsetof(config, clock), "ticks",
+        "time that ages BlockCacheImplV2 scores: ticks (requests replayed) or ts (trace "
+        "timestamps)" },
+    { "", "save_state", cmd_set_str, offsetof(config, save_state), nullptr,
+        "after the replay, save the state of every cache that supports it to this file" },
+    { "", "load_state", cmd_set_str, offsetof(config, load_state), nullptr,
+        "before the replay, restore caches from a file written by --save_state" } };
 
 int main(int argc, const char *argv[])
 {
@@ -816,17 +3859,116 @@ int main(int argc, const char *argv[])
     }
     free(errstr);
 
-    g_lru_cache = new LRUCache(g_cfg.capacity);
-    g_fifo_cache = new FIFOCache(g_cfg.capacity);
-    g_block_cache = new BlockCache(g_cfg.capacity);
-    g_block_cache_v2 = new BlockCacheV2(g_cfg.capacity);
+    if (g_cfg.bench > 0) {
+        run_bench();
+        return 0;
+    }
+
+    if (g_cfg.bench_blocks) {
+        run_block_bench();
+        return 0;
+    }
 
-    for (string line; std::getline(std::cin, line);) {
-        if (g_cfg.is_v2) {
-            process_line_v2(line);
+    if (!str_empty(g_cfg.convert)) {
+        TraceWriter writer(g_cfg.convert);
+        auto sink = [&writer](const Request &req) { writer.append(req); };
+        if (!str_empty(g_cfg.trace)) {
+            read_trace_file(g_cfg.trace, sink);
         } else {
-            process_line(line);
+            read_trace_stdin(sink);
         }
+        return 0;
+    }
+
+    if (g_cfg.sample_rate <= 0 || g_cfg.sample_rate > 1) {
+        log_fatal("sample_rate should be in (0, 1]");
+    }
+
+    // slices go whole only through the serial replay; elsewhere they would be split into
+    // parts, sampled by part and seen by range_lru as objects of their own
+    if (g_cfg.range && g_cfg.is_v2 && (g_cfg.pipeline || g_cfg.parse_threads > 1)) {
+        log_fatal("--range does not go with --pipeline or --parse_threads");
+    }
+    if (g_cfg.enable_range_lru && g_cfg.is_v2 && !g_cfg.range) {
+        log_fatal("--range_lru needs --range with --v2, or it takes every part for an object");
+    }
+
+    if (strcmp(g_cfg.log_gc, "utilization") != 0 && strcmp(g_cfg.log_gc, "fifo") != 0) {
+        log_fatal("unknown log_gc %s, should be utilization or fifo", g_cfg.log_gc);
+    }
+    if (g_cfg.block_size == 0) {
+        log_fatal("block_size should be positive");
+    }
+
+    if (strcmp(g_cfg.clock, "ts") == 0) {
+        g_clock_ts = true;
+    } else if (strcmp(g_cfg.clock, "ticks") != 0) {
+        log_fatal("unknown clock %s, should be ticks or ts", g_cfg.clock);
+    }
+
+    size_t capacity = g_cfg.capacity;
+    if (g_cfg.sample_rate < 1) {
+        g_sample_threshold = kSampleModulus * g_cfg.sample_rate;
+        capacity = capacity * g_cfg.sample_rate;
+        log_info("sampling %0.04f%% of keys, capacity scaled to %s", g_cfg.sample_rate * 100,
+            get_size_str(capacity).data());
+    }
+
+    MissRatioCurve mrc;
+    if (!str_empty(g_cfg.mrc)) {
+        vector<size_t> capacities;
+        char **arr = split_cstring(g_cfg.mrc, ",");
+        for (int i = 0; arr && arr[i] != NULL; i++) {
+            long cap = 0;
+            char *errstr2 = nullptr;
+            if (cmd_set_size(&cap, arr[i], &errstr2) != 0) {
+                log_fatal("invalid capacity %s in mrc: %s", arr[i], errstr2 ? errstr2 : "");
+            }
+            capacities.push_back(cap * g_cfg.sample_rate);
+            free(arr[i]);
+        }
+        free(arr);
+
+        if (capacities.empty()) {
+            log_fatal("mrc needs at least one capacity");
+        }
+        std::sort(capacities.begin(), capacities.end());
+        mrc = create_mrc(capacities, g_caches);
+    } else {
+        g_caches = create_caches(capacity);
+    }
+
+    if (!str_empty(g_cfg.load_state)) {
+        load_states(g_cfg.load_state, g_caches);
+    }
+
+    if (g_cfg.pipeline) {
+        g_pipeline = make_unique<Pipeline>(g_caches);
+    }
+
+    auto sink = [](const auto &req) { cache_get(req); };
+    if (!str_empty(g_cfg.trace)) {
+        read_trace_file(g_cfg.trace, sink);
+    } else {
+        read_trace_stdin(sink);
+    }
+
+    if (g_pipeline) {
+        g_pipeline->finish();
+    }
+    g_reporter.flush();
+
+    if (!str_empty(g_cfg.save_state)) {
+        save_states(g_cfg.save_state, g_caches);
+    }
+
+    if (!str_empty(g_cfg.mrc)) {
+        output_mrc(mrc, g_cfg.sample_rate);
+        return 0;
+    }
+
+    for (const auto &cache : g_caches) {
+        std::dynamic_pointer_cast<CacheStat>(cache)->log_summary();
     }
 
     return 0;
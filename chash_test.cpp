@@ -1,6 +1,12 @@
 #include "util.h"
+#include <atomic>
 #include <cmath>
+#include <functional>
+#include <immintrin.h>
+#include <limits>
+#include <mutex>
 #include <random>
+#include <shared_mutex>
 
 using std::default_random_engine;
 using std::make_shared;
@@ -10,6 +16,7 @@ using std::map;
 using std::shared_ptr;
 using std::sort;
 using std::string;
+using std::string_view;
 using std::to_string;
 using std::tuple;
 using std::unique_ptr;
@@ -63,6 +70,43 @@ uint32_t murmur_hash2(const string &s)
     return h;
 }
 
+// murmur_hash2(string((const char *)&k, sizeof(k))) on a little-endian machine, the
+// bytes sign-extended like the char loads there
+constexpr uint32_t murmur_hash2_u32(uint32_t k)
+{
+    const uint32_t m = 0x5bd1e995;
+    uint32_t w = (uint32_t)(int8_t)k | (uint32_t)(int8_t)(k >> 8) << 8
+        | (uint32_t)(int8_t)(k >> 16) << 16 | (uint32_t)(int8_t)(k >> 24) << 24;
+    w *= m;
+    w ^= w >> 24;
+    w *= m;
+
+    uint32_t h = 4 * m;
+    h ^= w;
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+    return h;
+}
+
+// murmur_hash2_u32 of 0 to N - 1, built by the compiler
+template <size_t N> struct MurmurTable {
+    constexpr MurmurTable()
+        : hashes()
+    {
+        for (size_t i = 0; i < N; i++) {
+            hashes[i] = murmur_hash2_u32(i);
+        }
+    }
+
+    uint32_t get(uint32_t k) const { return k < N ? hashes[k] : murmur_hash2_u32(k); }
+
+    uint32_t hashes[N];
+};
+
+// enough for the vnodes of a weight 25 node at 160 vnodes per weight
+static constexpr MurmurTable<4096> kMurmurTable;
+
 uint32_t xorshiftmul32(uint32_t x) {
     x ^= x << 13;
     x ^= x >> 17;
@@ -78,121 +122,487 @@ public:
     }
     virtual ~Hash() = default;
     virtual void init(vector<tuple<string, int>> nodes) = 0;
-    virtual string get(const string &key) = 0;
+    // the name of the node, valid until the next init
+    virtual string_view get(const string &key) = 0;
+    // the position of the node in the vector given to init, -1 without nodes
+    virtual int get_index(const string &key) = 0;
+    // out[i] = get_index(keys[i]), one virtual call for the whole batch
+    virtual void get_batch(const string *keys, size_t n, int *out)
+    {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = get_index(keys[i]);
+        }
+    }
     virtual string name() const = 0;
+    // bytes of the structures lookups read, 0 where it is not counted
+    virtual size_t memory() const { return 0; }
+
+    // keys are hashed in chunks of this many before the lookups
+    static constexpr size_t kBatch = 64;
 
 protected:
     hash_func_type hash_;
 };
 
-static bool vnode_compare(const tuple<uint32_t, int> &vnode1, const tuple<uint32_t, int> &vnode2)
+// murmur3's finalizer, a bijection
+static inline uint32_t fmix32(uint32_t h)
 {
-    return std::get<0>(vnode1) < std::get<0>(vnode2);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
 }
 
-class CHash : public Hash {
+static inline uint64_t fmix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// A point of the ring. Different nodes can put vnodes on the same hash (with murmur_hash2
+// every CHash node does for i >= 128, the sign-extended low byte swallows the id), so the
+// low half of key breaks ties with a mix of the hash and the node's name hash: each tied
+// point goes to a pseudo-random node, whatever order the nodes were given in.
+struct Vnode {
+    Vnode() = default;
+    Vnode(uint32_t hash, uint32_t sid, int owner)
+        : key((uint64_t)hash << 32 | fmix32(hash ^ sid))
+        , owner(owner)
+    {
+    }
+
+    uint32_t hash() const { return key >> 32; }
+
+    bool operator<(const Vnode &o) const
+    {
+        return key < o.key || (key == o.key && owner < o.owner);
+    }
+
+    uint64_t key;
+    int owner;
+};
+
+// LSD radix sort of vnodes by hash, 8 bits a pass. Each thread counts and then scatters
+// its own contiguous chunk into its own slice of every bucket, so the sort is stable:
+// vnodes with equal hashes keep their order. nthreads 0 picks one thread per 16K vnodes,
+// up to the number of CPUs.
+static void radix_sort_vnodes(vector<Vnode> &vnodes, unsigned nthreads = 0)
+{
+    static constexpr size_t kRadix = 256;
+    const size_t n = vnodes.size();
+    if (nthreads == 0) {
+        nthreads = std::min<size_t>(std::thread::hardware_concurrency(), n / 16384);
+    }
+    nthreads = std::max(1u, std::min<unsigned>(nthreads, std::max<size_t>(n, 1)));
+
+    vector<Vnode> buf(n);
+    vector<size_t> counts(nthreads * kRadix);
+    auto run = [nthreads](const std::function<void(unsigned)> &f) {
+        vector<std::thread> threads;
+        for (unsigned t = 1; t < nthreads; t++) {
+            threads.emplace_back(f, t);
+        }
+        f(0);
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    };
+
+    for (int shift = 32; shift < 64; shift += 8) {
+        std::fill(counts.begin(), counts.end(), 0);
+        run([&, shift](unsigned t) {
+            size_t *count = &counts[t * kRadix];
+            for (size_t i = n * t / nthreads; i < n * (t + 1) / nthreads; i++) {
+                count[(vnodes[i].key >> shift) & (kRadix - 1)]++;
+            }
+        });
+
+        // bucket by bucket, and within a bucket thread by thread
+        size_t sum = 0;
+        for (size_t d = 0; d < kRadix; d++) {
+            for (unsigned t = 0; t < nthreads; t++) {
+                size_t count = counts[t * kRadix + d];
+                counts[t * kRadix + d] = sum;
+                sum += count;
+            }
+        }
+
+        run([&, shift](unsigned t) {
+            size_t *offset = &counts[t * kRadix];
+            for (size_t i = n * t / nthreads; i < n * (t + 1) / nthreads; i++) {
+                buf[offset[(vnodes[i].key >> shift) & (kRadix - 1)]++] = vnodes[i];
+            }
+        });
+        vnodes.swap(buf);
+    }
+}
+
+// vnodes sorted by hash into the full Vnode order; equal hashes are rare, so this is a
+// scan with the odd short sort
+static void sort_ties(vector<Vnode> &vnodes)
+{
+    for (size_t i = 0; i < vnodes.size();) {
+        size_t j = i + 1;
+        while (j < vnodes.size() && vnodes[j].hash() == vnodes[i].hash()) {
+            j++;
+        }
+        if (j - i > 1) {
+            sort(vnodes.begin() + i, vnodes.begin() + j);
+        }
+        i = j;
+    }
+}
+
+// Sorted vnode ring as a structure of arrays, searched through a static B-tree of
+// 16-hash nodes: one node is a cache line, the children of node k are k * 17 + 1 to
+// k * 17 + 17, so a lookup reads one line per level instead of bisecting the whole
+// array. Hashes are stored with the sign bit flipped, so a node is ranked with signed
+// compares, two AVX2 instructions where the CPU has them.
+class VnodeRing {
 public:
-    CHash(hash_func_type hash = murmur_hash2, int vnode_num = 160)
-        : Hash(hash)
-        , vnode_num_(vnode_num)
+    // hashes sorted ascending, owners[i] is the node of hashes[i]
+    void build(vector<uint32_t> hashes, vector<int> owners)
     {
+        hashes_ = std::move(hashes);
+        owners_ = std::move(owners);
+
+        nblocks_ = (hashes_.size() + kB - 1) / kB;
+        tree_.assign(nblocks_, Block {});
+        tree_owners_.assign(nblocks_ * kB, 0);
+        size_t t = 0;
+        fill(0, t);
     }
 
-    virtual void get_vnodes(vector<tuple<string, int>> nodes)
+    size_t size() const { return hashes_.size(); }
+    const vector<uint32_t> &hashes() const { return hashes_; }
+    const vector<int> &owners() const { return owners_; }
+
+    size_t memory() const
     {
-        for (int rnode_index = 0; rnode_index < nodes.size(); rnode_index++) {
-            auto const &node = nodes[rnode_index];
-            const string &name = std::get<0>(node);
-            rnodes_.emplace_back(name);
-            uint32_t sid = hash_(name);
-            int num = std::get<1>(node) * vnode_num_;
-            for (int i = 0; i < num; i++) {
-                uint32_t id = sid * 256 * 16 + i;
-                uint32_t h = hash_(string((const char *)&id, sizeof(id)));
-                vnodes_.emplace_back(make_tuple(h, rnode_index));
+        return hashes_.capacity() * sizeof(uint32_t) + owners_.capacity() * sizeof(int)
+            + tree_.capacity() * sizeof(Block) + tree_owners_.capacity() * sizeof(int);
+    }
+
+    // the owner of the first vnode at or after h, wrapping around to the first vnode
+    int lower_bound(uint32_t h) const
+    {
+        const int32_t x = (int32_t)(h ^ kSignBit);
+        size_t found = kNotFound;
+        for (size_t k = 0; k < nblocks_;) {
+            size_t i = rank(tree_[k].keys, x);
+            if (i < kB) {
+                found = k * kB + i;
+            }
+            k = k * (kB + 1) + i + 1;
+        }
+        return found == kNotFound ? owners_[0] : tree_owners_[found];
+    }
+
+    // lower_bound of n hashes, walked down the tree side by side so that the node
+    // each one needs next is prefetched while the others are ranked
+    void lower_bound_batch(const uint32_t *hs, size_t n, int *out) const
+    {
+        static constexpr size_t kLanes = 16;
+        int32_t xs[kLanes];
+        size_t ks[kLanes];
+        size_t found[kLanes];
+
+        for (size_t base = 0; base < n; base += kLanes) {
+            size_t m = std::min(kLanes, n - base);
+            for (size_t j = 0; j < m; j++) {
+                xs[j] = (int32_t)(hs[base + j] ^ kSignBit);
+                ks[j] = 0;
+                found[j] = kNotFound;
+            }
+
+            for (bool active = nblocks_ > 0; active;) {
+                active = false;
+                for (size_t j = 0; j < m; j++) {
+                    if (ks[j] >= nblocks_) {
+                        continue;
+                    }
+                    size_t i = rank(tree_[ks[j]].keys, xs[j]);
+                    if (i < kB) {
+                        found[j] = ks[j] * kB + i;
+                    }
+                    ks[j] = ks[j] * (kB + 1) + i + 1;
+                    if (ks[j] < nblocks_) {
+                        __builtin_prefetch(&tree_[ks[j]]);
+                        active = true;
+                    }
+                }
+            }
+
+            for (size_t j = 0; j < m; j++) {
+                out[base + j] = found[j] == kNotFound ? owners_[0] : tree_owners_[found[j]];
+            }
+        }
+    }
+
+private:
+    static constexpr size_t kB = 16;
+    static constexpr uint32_t kSignBit = 0x80000000;
+    static constexpr size_t kNotFound = SIZE_MAX;
+
+    struct alignas(64) Block {
+        int32_t keys[kB];
+    };
+
+    // in-order walk, so the hashes land in the tree in ascending order; the slots left
+    // over hold the largest key and point at the first vnode like the wrap-around does
+    void fill(size_t k, size_t &t)
+    {
+        if (k >= nblocks_) {
+            return;
+        }
+        for (size_t i = 0; i < kB; i++) {
+            fill(k * (kB + 1) + i + 1, t);
+            if (t < hashes_.size()) {
+                tree_[k].keys[i] = (int32_t)(hashes_[t] ^ kSignBit);
+                tree_owners_[k * kB + i] = owners_[t];
+                t++;
+            } else {
+                tree_[k].keys[i] = INT32_MAX;
+                tree_owners_[k * kB + i] = owners_[0];
             }
         }
+        fill(k * (kB + 1) + kB + 1, t);
+    }
+
+    // number of keys of the node below x
+    static size_t rank(const int32_t *keys, int32_t x)
+    {
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        return has_avx2 ? rank_avx2(keys, x) : rank_scalar(keys, x);
+    }
+
+    static size_t rank_scalar(const int32_t *keys, int32_t x)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < kB; i++) {
+            n += keys[i] < x;
+        }
+        return n;
+    }
+
+    __attribute__((target("avx2"))) static size_t rank_avx2(const int32_t *keys, int32_t x)
+    {
+        __m256i v = _mm256_set1_epi32(x);
+        __m256i lo = _mm256_cmpgt_epi32(v, _mm256_load_si256((const __m256i *)keys));
+        __m256i hi = _mm256_cmpgt_epi32(v, _mm256_load_si256((const __m256i *)(keys + 8)));
+        uint32_t mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(lo))
+            | (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(hi)) << 8;
+        return __builtin_popcount(mask);
+    }
+
+private:
+    vector<uint32_t> hashes_;
+    vector<int> owners_;
+    vector<Block> tree_;
+    vector<int> tree_owners_;
+    size_t nblocks_ = 0;
+};
+
+// Vnodes are kept in Vnode order, so a full build and any sequence of incremental ones
+// give the same ring. A full build sorts with radix_sort_vnodes; when only a few nodes
+// change, init drops the vnodes of the removed or reweighted ones, hashes just the new
+// ones and merges them in.
+class CHash : public Hash {
+public:
+    CHash(hash_func_type hash = murmur_hash2, int vnode_num = 160)
+        : Hash(hash)
+        , vnode_num_(vnode_num)
+    {
     }
 
     void init(vector<tuple<string, int>> nodes) override
     {
         rnodes_.clear();
-        vnodes_.clear();
-        get_vnodes(nodes);
+        vector<uint32_t> sids;
+        for (const auto &node : nodes) {
+            rnodes_.emplace_back(std::get<0>(node));
+            sids.push_back(hash_(std::get<0>(node)));
+        }
 
-        elapsed e("sort");
-        sort(vnodes_.begin(), vnodes_.end(), vnode_compare);
+        if (!init_incremental(nodes, sids)) {
+            init_full(nodes, sids);
+        }
+        nodes_ = std::move(nodes);
+        sids_ = std::move(sids);
     }
 
-    string get(const string &key) override
+    string_view get(const string &key) override
     {
-        if (rnodes_.empty()) {
+        int index = CHash::get_index(key);
+        if (index < 0) {
             return "";
         }
+        return rnodes_[index];
+    }
 
-        tuple<uint32_t, int> v = { hash_(key), 0 };
-        auto it = lower_bound(vnodes_.cbegin(), vnodes_.cend(), v, vnode_compare);
-        if (it == vnodes_.cend()) {
-            it = vnodes_.cbegin();
+    int get_index(const string &key) override
+    {
+        if (ring_.size() == 0) {
+            return -1;
         }
-        return rnodes_[std::get<1>(*it)];
+        return ring_.lower_bound(hash_(key));
     }
 
-    string name() const override { return get_filt_type_name<decltype(*this)>(); }
+    size_t memory() const override { return ring_.memory(); }
 
-protected:
-    int vnode_num_;
-    vector<string> rnodes_;
-    vector<tuple<uint32_t, int>> vnodes_;
-};
+    void get_batch(const string *keys, size_t n, int *out) override
+    {
+        if (ring_.size() == 0) {
+            std::fill(out, out + n, -1);
+            return;
+        }
 
-class CHash2 : public CHash {
-public:
-    CHash2(hash_func_type hash = murmur_hash2, int vnode_num = 160)
-        : CHash(hash, vnode_num)
+        uint32_t hs[kBatch];
+        for (size_t base = 0; base < n; base += kBatch) {
+            size_t m = std::min(kBatch, n - base);
+            for (size_t j = 0; j < m; j++) {
+                hs[j] = hash_(keys[base + j]);
+            }
+            ring_.lower_bound_batch(hs, m, out + base);
+        }
+    }
+
+    string name() const override { return string(type_name<decltype(*this)>()); }
+
+protected:
+    // the hash of the i-th vnode of a node whose name hashes to sid
+    virtual uint32_t vnode_hash(uint32_t sid, uint32_t i) const
     {
+        uint32_t id = sid * 256 * 16 + i;
+        if (hash_ == murmur_hash2) {
+            return murmur_hash2_u32(id);
+        }
+        return hash_(string((const char *)&id, sizeof(id)));
     }
 
-    void get_vnodes(vector<tuple<string, int>> nodes) override {
-        hit_count_ = 0;
-        miss_count_ = 0;
+private:
+    void add_vnodes(int weight, uint32_t sid, int rnode_index, vector<Vnode> *vnodes) const
+    {
+        int num = weight * vnode_num_;
+        for (int i = 0; i < num; i++) {
+            vnodes->emplace_back(vnode_hash(sid, i), sid, rnode_index);
+        }
+    }
 
+    void init_full(const vector<tuple<string, int>> &nodes, const vector<uint32_t> &sids)
+    {
+        vector<Vnode> vnodes;
         for (int rnode_index = 0; rnode_index < nodes.size(); rnode_index++) {
-            auto const &node = nodes[rnode_index];
-            const string &name = std::get<0>(node);
-            rnodes_.emplace_back(name);
-            int num = std::get<1>(node) * vnode_num_;
-            uint32_t sid = hash_(name);
-            for (int i = 0; i < num; i++) {
-                // string key = name + "_" + std::to_string(i);
-                // uint32_t h = hash_(key);
-                uint32_t h = xorshiftmul32(sid ^ (murmur_table_get(i)));
-                vnodes_.emplace_back(make_tuple(h, rnode_index));
-            }
+            add_vnodes(std::get<1>(nodes[rnode_index]), sids[rnode_index], rnode_index, &vnodes);
         }
 
-        log_debug("hit_count = %d miss_count = %d", hit_count_, miss_count_);
+        {
+            elapsed e("sort");
+            radix_sort_vnodes(vnodes);
+            sort_ties(vnodes);
+        }
+        build(vnodes);
     }
 
-    string name() const override { return get_filt_type_name<decltype(*this)>(); }
+    // false when there is no previous ring or more than half of the weight changed
+    bool init_incremental(const vector<tuple<string, int>> &nodes, const vector<uint32_t> &sids)
+    {
+        if (nodes_.empty() || ring_.size() == 0) {
+            return false;
+        }
+
+        unordered_map<string, int> old_index;
+        for (int i = 0; i < nodes_.size(); i++) {
+            old_index.emplace(std::get<0>(nodes_[i]), i);
+        }
 
-private:
-    uint32_t murmur_table_get(int k)
+        // old owner -> new owner, -1 for nodes whose vnodes go away
+        vector<int> remap(nodes_.size(), -1);
+        vector<int> added;
+        long kept_weight = 0;
+        long total_weight = 0;
+        for (int i = 0; i < nodes.size(); i++) {
+            total_weight += std::get<1>(nodes[i]);
+            auto it = old_index.find(std::get<0>(nodes[i]));
+            if (it != old_index.end() && std::get<1>(nodes_[it->second]) == std::get<1>(nodes[i])
+                && remap[it->second] < 0) {
+                remap[it->second] = i;
+                kept_weight += std::get<1>(nodes[i]);
+            } else {
+                added.push_back(i);
+            }
+        }
+        if (kept_weight * 2 < total_weight) {
+            return false;
+        }
+
+        const vector<uint32_t> &hashes = ring_.hashes();
+        const vector<int> &owners = ring_.owners();
+        vector<Vnode> kept;
+        kept.reserve(total_weight * vnode_num_);
+        for (size_t i = 0; i < hashes.size(); i++) {
+            int owner = remap[owners[i]];
+            if (owner >= 0) {
+                kept.emplace_back(hashes[i], sids_[owners[i]], owner);
+            }
+        }
+        // renumbering the owners only reorders vnodes within runs of equal hashes
+        sort_ties(kept);
+
+        vector<Vnode> fresh;
+        for (int i : added) {
+            add_vnodes(std::get<1>(nodes[i]), sids[i], i, &fresh);
+        }
+        sort(fresh.begin(), fresh.end());
+
+        vector<Vnode> vnodes(kept.size() + fresh.size());
+        std::merge(kept.begin(), kept.end(), fresh.begin(), fresh.end(), vnodes.begin());
+        build(vnodes);
+        return true;
+    }
+
+    void build(const vector<Vnode> &vnodes)
     {
-        if (murmur_table_.find(k) == murmur_table_.end()) {
-            murmur_table_[k] = murmur_hash2(string((const char *)&k, sizeof(k)));
-            miss_count_++;
-        } else {
-            hit_count_++;
+        vector<uint32_t> hashes;
+        vector<int> owners;
+        hashes.reserve(vnodes.size());
+        owners.reserve(vnodes.size());
+        for (const auto &vnode : vnodes) {
+            hashes.push_back(vnode.hash());
+            owners.push_back(vnode.owner);
         }
+        ring_.build(std::move(hashes), std::move(owners));
+    }
+
+protected:
+    int vnode_num_;
+    vector<string> rnodes_;
+    // the nodes of the last init, what the next one is diffed against, and their hashes
+    vector<tuple<string, int>> nodes_;
+    vector<uint32_t> sids_;
+    VnodeRing ring_;
+};
 
-        return murmur_table_[k];
+class CHash2 : public CHash {
+public:
+    CHash2(hash_func_type hash = murmur_hash2, int vnode_num = 160)
+        : CHash(hash, vnode_num)
+    {
     }
 
-private:
-    int hit_count_ = 0;
-    int miss_count_ = 0;
-    unordered_map<int, uint32_t> murmur_table_;
+    string name() const override { return string(type_name<decltype(*this)>()); }
+
+protected:
+    uint32_t vnode_hash(uint32_t sid, uint32_t i) const override
+    {
+        return xorshiftmul32(sid ^ kMurmurTable.get(i));
+    }
 };
 
 struct Node {
@@ -276,195 +686,1467 @@ public:
             });
     }
 
-    string get(const string &key) override
+    string_view get(const string &key) override
     {
-        if (nodes_.empty()) {
+        int index = HRWHash::get_index(key);
+        if (index < 0) {
             return "";
         }
+        return nodes_[index].name;
+    }
 
-        uint64_t khash = hash64(key);
+    int get_index(const string &key) override
+    {
+        if (nodes_.empty()) {
+            return -1;
+        }
+
+        return max_score_index(hash64(key));
+    }
+
+    void get_batch(const string *keys, size_t n, int *out) override
+    {
+        if (nodes_.empty()) {
+            std::fill(out, out + n, -1);
+            return;
+        }
+
+        uint64_t khashes[kBatch];
+        for (size_t base = 0; base < n; base += kBatch) {
+            size_t m = std::min(kBatch, n - base);
+            for (size_t j = 0; j < m; j++) {
+                khashes[j] = hash64(keys[base + j]);
+            }
+            for (size_t j = 0; j < m; j++) {
+                out[base + j] = max_score_index(khashes[j]);
+            }
+        }
+    }
+
+    string name() const override { return string(type_name<decltype(*this)>()); }
+
+private:
+    static uint64_t xorshiftmul64(uint64_t x)
+    {
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        return x * 2685821657736338717;
+    }
+
+    static double score(uint64_t khash, const Node &node)
+    {
+        uint64_t tmp1 = xorshiftmul64(khash ^ node.hash);
+        return -node.weight / std::log(((double)tmp1 / 0xFFFFFFFFFFFFFFFFUL));
+    }
+
+    int max_score_index(uint64_t khash) const
+    {
         int max_index = 0;
-        const Node &first_node = nodes_[0];
-        uint64_t tmp1 = xorshiftmul64(khash ^ first_node.hash);
-        double max_hash = -first_node.weight / std::log(((double)tmp1 / 0xFFFFFFFFFFFFFFFFUL));
+        double max_hash = score(khash, nodes_[0]);
 
         for (int i = 1; i < nodes_.size(); i++) {
-            const Node &node = nodes_[i];
-            tmp1 = xorshiftmul64(khash ^ node.hash);
-            double tmp2 = -node.weight / std::log(((double)tmp1 / 0xFFFFFFFFFFFFFFFFUL));
+            double tmp2 = score(khash, nodes_[i]);
             if (tmp2 > max_hash) {
                 max_hash = tmp2;
                 max_index = i;
             }
         }
 
-        return nodes_[max_index].name;
+        return max_index;
+    }
+
+private:
+    vector<Node> nodes_;
+};
+
+// Weighted HRW scoring with a cheap logarithm, so that many nodes can be scored per
+// instruction. A score is -weight / ln(u) like HRWHash, with u = xorshiftmul64(khash ^
+// node hash) / 2^64, but ln(u) comes from the exponent of u and a short series for the
+// mantissa instead of std::log. The scalar, AVX2 and AVX-512 kernels do the same IEEE
+// operations in the same order (the build keeps the compiler from fusing multiply-adds),
+// so they pick the same node for every key.
+namespace fast_hrw {
+
+static const uint64_t kMagic = 0x4330000000000000ULL; // 2^52 as a double
+static const uint64_t kMantissa = 0x000FFFFFFFFFFFFFULL;
+static const uint64_t kOne = 0x3FF0000000000000ULL;
+static const uint64_t kMul = 2685821657736338717ULL;
+static const double kLn2 = 0.6931471805599453;
+
+static inline double from_bits(uint64_t bits)
+{
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static inline uint64_t to_bits(double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+// negw is the node's weight negated; x = khash ^ node hash
+static inline double score(uint64_t x, double negw)
+{
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    x *= kMul;
+
+    // the top 52 bits of u * 2^64, exactly, then its exponent and mantissa m in [1, 2)
+    const double d = from_bits((x >> 12) | kMagic) - 0x1p52;
+    const uint64_t bits = to_bits(d);
+    const double e = (from_bits((bits >> 52) | kMagic) - 0x1p52) - 1075.0;
+    const double m = from_bits((bits & kMantissa) | kOne);
+
+    // ln(m) = 2 * atanh((m - 1) / (m + 1)), the series is below 1e-6 off for m < 2
+    const double s = (m - 1) / (m + 1);
+    const double s2 = s * s;
+    const double poly = 1 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 * (1.0 / 9))));
+    const double lnu = e * kLn2 + (2 * s) * poly;
+    return negw / lnu;
+}
+
+// index of the highest score among n nodes, the first one on ties
+static int max_index_scalar(uint64_t khash, const uint64_t *hashes, const double *negw, size_t n)
+{
+    double max = -INFINITY;
+    int max_index = -1;
+    for (size_t i = 0; i < n; i++) {
+        double s = score(khash ^ hashes[i], negw[i]);
+        if (s > max) {
+            max = s;
+            max_index = i;
+        }
+    }
+    return max_index;
+}
+
+// per-lane winners, then the tail; lanes only win ties from higher indices
+static int finish(const double *lane_max, const int64_t *lane_index, size_t lanes, size_t done,
+    uint64_t khash, const uint64_t *hashes, const double *negw, size_t n)
+{
+    double max = -INFINITY;
+    int max_index = -1;
+    if (done > 0) {
+        for (size_t l = 0; l < lanes; l++) {
+            if (lane_max[l] > max || (lane_max[l] == max && lane_index[l] < max_index)) {
+                max = lane_max[l];
+                max_index = lane_index[l];
+            }
+        }
+    }
+    for (size_t i = done; i < n; i++) {
+        double s = score(khash ^ hashes[i], negw[i]);
+        if (s > max) {
+            max = s;
+            max_index = i;
+        }
+    }
+    return max_index;
+}
+
+// 64-bit multiply by a constant out of 32-bit multiplies, AVX2 has no vpmullq
+__attribute__((target("avx2"))) static inline __m256i mul64_avx2(__m256i a, uint64_t c)
+{
+    const __m256i lo = _mm256_set1_epi64x(c & 0xFFFFFFFF);
+    const __m256i hi = _mm256_set1_epi64x(c >> 32);
+    __m256i cross = _mm256_add_epi64(
+        _mm256_mul_epu32(_mm256_srli_epi64(a, 32), lo), _mm256_mul_epu32(a, hi));
+    return _mm256_add_epi64(_mm256_mul_epu32(a, lo), _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2"))) static inline __m256d score_avx2(__m256i x, __m256d negw)
+{
+    const __m256i magic = _mm256_set1_epi64x(kMagic);
+    const __m256d two52 = _mm256_set1_pd(0x1p52);
+    const __m256d one = _mm256_set1_pd(1);
+
+    x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 12));
+    x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 25));
+    x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 27));
+    x = mul64_avx2(x, kMul);
+
+    __m256d d = _mm256_sub_pd(
+        _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(x, 12), magic)), two52);
+    __m256i bits = _mm256_castpd_si256(d);
+    __m256d e = _mm256_sub_pd(
+        _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), magic)),
+            two52),
+        _mm256_set1_pd(1075.0));
+    __m256d m = _mm256_castsi256_pd(_mm256_or_si256(
+        _mm256_and_si256(bits, _mm256_set1_epi64x(kMantissa)), _mm256_set1_epi64x(kOne)));
+
+    __m256d s = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+    __m256d s2 = _mm256_mul_pd(s, s);
+    __m256d poly = _mm256_add_pd(_mm256_set1_pd(1.0 / 7), _mm256_mul_pd(s2, _mm256_set1_pd(1.0 / 9)));
+    poly = _mm256_add_pd(_mm256_set1_pd(1.0 / 5), _mm256_mul_pd(s2, poly));
+    poly = _mm256_add_pd(_mm256_set1_pd(1.0 / 3), _mm256_mul_pd(s2, poly));
+    poly = _mm256_add_pd(one, _mm256_mul_pd(s2, poly));
+    __m256d lnu = _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(kLn2)),
+        _mm256_mul_pd(_mm256_add_pd(s, s), poly));
+    return _mm256_div_pd(negw, lnu);
+}
+
+__attribute__((target("avx2"))) static int max_index_avx2(
+    uint64_t khash, const uint64_t *hashes, const double *negw, size_t n)
+{
+    const __m256i k = _mm256_set1_epi64x(khash);
+    __m256d best = _mm256_set1_pd(-INFINITY);
+    __m256i best_index = _mm256_setzero_si256();
+    __m256i index = _mm256_set_epi64x(3, 2, 1, 0);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_xor_si256(k, _mm256_loadu_si256((const __m256i *)(hashes + i)));
+        __m256d s = score_avx2(x, _mm256_loadu_pd(negw + i));
+        __m256d gt = _mm256_cmp_pd(s, best, _CMP_GT_OQ);
+        best = _mm256_blendv_pd(best, s, gt);
+        best_index = _mm256_castpd_si256(_mm256_blendv_pd(
+            _mm256_castsi256_pd(best_index), _mm256_castsi256_pd(index), gt));
+        index = _mm256_add_epi64(index, _mm256_set1_epi64x(4));
+    }
+
+    alignas(32) double lane_max[4];
+    alignas(32) int64_t lane_index[4];
+    _mm256_store_pd(lane_max, best);
+    _mm256_store_si256((__m256i *)lane_index, best_index);
+    // finish() is plain SSE code, dirty upper halves would make every SSE op pay for them
+    _mm256_zeroupper();
+    return finish(lane_max, lane_index, 4, i, khash, hashes, negw, n);
+}
+
+__attribute__((target("avx512f"))) static inline __m512i mul64_avx512(__m512i a, uint64_t c)
+{
+    const __m512i lo = _mm512_set1_epi64(c & 0xFFFFFFFF);
+    const __m512i hi = _mm512_set1_epi64(c >> 32);
+    __m512i cross = _mm512_add_epi64(
+        _mm512_mul_epu32(_mm512_srli_epi64(a, 32), lo), _mm512_mul_epu32(a, hi));
+    return _mm512_add_epi64(_mm512_mul_epu32(a, lo), _mm512_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx512f"))) static inline __m512d score_avx512(__m512i x, __m512d negw)
+{
+    const __m512i magic = _mm512_set1_epi64(kMagic);
+    const __m512d two52 = _mm512_set1_pd(0x1p52);
+    const __m512d one = _mm512_set1_pd(1);
+
+    x = _mm512_xor_si512(x, _mm512_srli_epi64(x, 12));
+    x = _mm512_xor_si512(x, _mm512_slli_epi64(x, 25));
+    x = _mm512_xor_si512(x, _mm512_srli_epi64(x, 27));
+    x = mul64_avx512(x, kMul);
+
+    __m512d d = _mm512_sub_pd(
+        _mm512_castsi512_pd(_mm512_or_si512(_mm512_srli_epi64(x, 12), magic)), two52);
+    __m512i bits = _mm512_castpd_si512(d);
+    __m512d e = _mm512_sub_pd(
+        _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(_mm512_srli_epi64(bits, 52), magic)),
+            two52),
+        _mm512_set1_pd(1075.0));
+    __m512d m = _mm512_castsi512_pd(_mm512_or_si512(
+        _mm512_and_si512(bits, _mm512_set1_epi64(kMantissa)), _mm512_set1_epi64(kOne)));
+
+    __m512d s = _mm512_div_pd(_mm512_sub_pd(m, one), _mm512_add_pd(m, one));
+    __m512d s2 = _mm512_mul_pd(s, s);
+    __m512d poly = _mm512_add_pd(_mm512_set1_pd(1.0 / 7), _mm512_mul_pd(s2, _mm512_set1_pd(1.0 / 9)));
+    poly = _mm512_add_pd(_mm512_set1_pd(1.0 / 5), _mm512_mul_pd(s2, poly));
+    poly = _mm512_add_pd(_mm512_set1_pd(1.0 / 3), _mm512_mul_pd(s2, poly));
+    poly = _mm512_add_pd(one, _mm512_mul_pd(s2, poly));
+    __m512d lnu = _mm512_add_pd(_mm512_mul_pd(e, _mm512_set1_pd(kLn2)),
+        _mm512_mul_pd(_mm512_add_pd(s, s), poly));
+    return _mm512_div_pd(negw, lnu);
+}
+
+__attribute__((target("avx512f"))) static int max_index_avx512(
+    uint64_t khash, const uint64_t *hashes, const double *negw, size_t n)
+{
+    const __m512i k = _mm512_set1_epi64(khash);
+    __m512d best = _mm512_set1_pd(-INFINITY);
+    __m512i best_index = _mm512_setzero_si512();
+    __m512i index = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i x = _mm512_xor_si512(k, _mm512_loadu_si512(hashes + i));
+        __m512d s = score_avx512(x, _mm512_loadu_pd(negw + i));
+        __mmask8 gt = _mm512_cmp_pd_mask(s, best, _CMP_GT_OQ);
+        best = _mm512_mask_blend_pd(gt, best, s);
+        best_index = _mm512_mask_blend_epi64(gt, best_index, index);
+        index = _mm512_add_epi64(index, _mm512_set1_epi64(8));
+    }
+
+    alignas(64) double lane_max[8];
+    alignas(64) int64_t lane_index[8];
+    _mm512_store_pd(lane_max, best);
+    _mm512_store_si512(lane_index, best_index);
+    _mm256_zeroupper();
+    return finish(lane_max, lane_index, 8, i, khash, hashes, negw, n);
+}
+
+typedef int (*kernel_type)(uint64_t, const uint64_t *, const double *, size_t);
+
+enum class Kernel { best, scalar, avx2, avx512 };
+
+static kernel_type get_kernel(Kernel kernel, const char **name)
+{
+    if (kernel == Kernel::best) {
+        if (__builtin_cpu_supports("avx512f")) {
+            kernel = Kernel::avx512;
+        } else if (__builtin_cpu_supports("avx2")) {
+            kernel = Kernel::avx2;
+        } else {
+            kernel = Kernel::scalar;
+        }
+    }
+
+    switch (kernel) {
+    case Kernel::avx512:
+        *name = "avx512";
+        return max_index_avx512;
+    case Kernel::avx2:
+        *name = "avx2";
+        return max_index_avx2;
+    default:
+        *name = "scalar";
+        return max_index_scalar;
+    }
+}
+
+} // namespace fast_hrw
+
+// HRWHash on the fast_hrw kernels: node hashes and negated weights side by side in
+// plain arrays, each lookup one kernel call over all of them.
+class FastHRWHash : public Hash {
+public:
+    FastHRWHash(fast_hrw::Kernel kernel = fast_hrw::Kernel::best)
+        : Hash(murmur_hash2)
+    {
+        kernel_ = fast_hrw::get_kernel(kernel, &kernel_name_);
+    }
+
+    void init(vector<tuple<string, int>> nodes) override
+    {
+        names_.clear();
+        hashes_.clear();
+        negw_.clear();
+        for (const auto &node : nodes) {
+            names_.push_back(std::get<0>(node));
+            hashes_.push_back(hash64(std::get<0>(node)));
+            negw_.push_back(-std::get<1>(node));
+        }
+    }
+
+    string_view get(const string &key) override
+    {
+        int index = FastHRWHash::get_index(key);
+        if (index < 0) {
+            return "";
+        }
+        return names_[index];
+    }
+
+    int get_index(const string &key) override
+    {
+        return kernel_(hash64(key), hashes_.data(), negw_.data(), hashes_.size());
+    }
+
+    void get_batch(const string *keys, size_t n, int *out) override
+    {
+        uint64_t khashes[kBatch];
+        for (size_t base = 0; base < n; base += kBatch) {
+            size_t m = std::min(kBatch, n - base);
+            for (size_t j = 0; j < m; j++) {
+                khashes[j] = hash64(keys[base + j]);
+            }
+            for (size_t j = 0; j < m; j++) {
+                out[base + j] = kernel_(khashes[j], hashes_.data(), negw_.data(), hashes_.size());
+            }
+        }
+    }
+
+    size_t memory() const override
+    {
+        return hashes_.capacity() * sizeof(uint64_t) + negw_.capacity() * sizeof(double);
+    }
+
+    string name() const override
+    {
+        return string(type_name<decltype(*this)>()) + "(" + kernel_name_ + ")";
+    }
+
+private:
+    fast_hrw::kernel_type kernel_;
+    const char *kernel_name_;
+    vector<string> names_;
+    vector<uint64_t> hashes_;
+    vector<double> negw_;
+};
+
+// Skeleton-based HRW: a tree of virtual clusters, kFanout children per cluster, with the
+// smallest power of kFanout leaves that leaves about kFanout nodes or fewer per leaf. A
+// node joins the leaf its name hashes to, and a cluster weighs what the nodes under it
+// weigh. A lookup runs HRW among the kFanout children of one cluster per level, from the
+// top down, then among the nodes of the leaf it reaches, so it scores about kFanout *
+// (log(n) / log(kFanout) + 1) candidates instead of n. Adding or removing a node only
+// changes the weights on its own path, so the keys that move are those of the node and,
+// as the clusters on the path get lighter or heavier, a few of the other nodes under
+// them: with 64 nodes, removing any one keeps 97.3% of the keys, against 98.4% for
+// HRWHash.
+//
+// The shape depends on the node count alone, so that every instance given the same nodes
+// routes alike, and changes only when the count crosses kFanout times a power of kFanout.
+// A cluster at depth d is named by the low d base-kFanout digits of its nodes' leaf hash,
+// so the clusters above the leaves keep their names and weights, and a new level splits
+// every leaf into kFanout. A key then stays with the nodes of its old leaf but is mostly
+// handed to another of them: going from 65 nodes to 64, or from 513 to 512, keeps only
+// about 23% of the keys. A membership that hovers around such a count is better served
+// by FastHRWHash.
+class SkeletonHRWHash : public Hash {
+public:
+    SkeletonHRWHash(fast_hrw::Kernel kernel = fast_hrw::Kernel::best)
+        : Hash(murmur_hash2)
+    {
+        kernel_ = fast_hrw::get_kernel(kernel, &kernel_name_);
+    }
+
+    void init(vector<tuple<string, int>> nodes) override
+    {
+        names_.clear();
+        levels_.clear();
+        if (nodes.empty()) {
+            return;
+        }
+
+        size_t leaves = kFanout;
+        while (leaves * kFanout < nodes.size()) {
+            leaves *= kFanout;
+        }
+
+        // the nodes of each leaf side by side, in list order
+        vector<size_t> leaf_of(nodes.size());
+        begins_.assign(leaves + 1, 0);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            names_.push_back(std::get<0>(nodes[i]));
+            leaf_of[i] = fmix64(hash64(names_[i])) % leaves;
+            begins_[leaf_of[i] + 1]++;
+        }
+        std::partial_sum(begins_.begin(), begins_.end(), begins_.begin());
+        members_.assign(nodes.size(), 0);
+        member_hashes_.assign(nodes.size(), 0);
+        member_negw_.assign(nodes.size(), 0);
+        vector<size_t> next(begins_.begin(), begins_.end() - 1);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            size_t m = next[leaf_of[i]]++;
+            members_[m] = i;
+            member_hashes_[m] = hash64(names_[i]);
+            member_negw_[m] = -std::get<1>(nodes[i]);
+        }
+
+        // the clusters of a depth, indexed by name, weighed from the leaves up
+        vector<double> negw(leaves);
+        for (size_t c = 0; c < leaves; c++) {
+            negw[c] = std::accumulate(
+                member_negw_.begin() + begins_[c], member_negw_.begin() + begins_[c + 1], 0.0);
+        }
+        size_t depth = 0;
+        for (size_t n = leaves; n > 1; n /= kFanout) {
+            depth++;
+        }
+        levels_.resize(depth);
+        for (size_t n = leaves; n > 1; n /= kFanout, depth--) {
+            // cluster c + j * parents is child j of cluster c, the kFanout side by side
+            size_t parents = n / kFanout;
+            Level &level = levels_[depth - 1];
+            level.hashes.resize(n);
+            level.negw.resize(n);
+            vector<double> parent_negw(parents, 0.0);
+            for (size_t c = 0; c < n; c++) {
+                size_t pos = c % parents * kFanout + c / parents;
+                level.hashes[pos] = hash64("cluster:" + to_string(depth) + ":" + to_string(c));
+                level.negw[pos] = negw[c];
+                parent_negw[c % parents] += negw[c];
+            }
+            negw = std::move(parent_negw);
+        }
+    }
+
+    string_view get(const string &key) override
+    {
+        int index = SkeletonHRWHash::get_index(key);
+        if (index < 0) {
+            return "";
+        }
+        return names_[index];
+    }
+
+    int get_index(const string &key) override
+    {
+        if (levels_.empty()) {
+            return -1;
+        }
+
+        // empty clusters weigh 0 and score -0, below any cluster with nodes
+        uint64_t khash = hash64(key);
+        size_t cluster = 0;
+        size_t stride = 1;
+        for (const Level &level : levels_) {
+            size_t begin = cluster * kFanout;
+            cluster += stride * kernel_(khash, &level.hashes[begin], &level.negw[begin], kFanout);
+            stride *= kFanout;
+        }
+        size_t begin = begins_[cluster];
+        int member = kernel_(
+            khash, &member_hashes_[begin], &member_negw_[begin], begins_[cluster + 1] - begin);
+        // only when every node weighs 0
+        if (member < 0) {
+            return -1;
+        }
+        return members_[begin + member];
+    }
+
+    string name() const override
+    {
+        return string(type_name<decltype(*this)>()) + "(" + kernel_name_ + ")";
+    }
+
+private:
+    static constexpr size_t kFanout = 8;
+
+    struct Level {
+        vector<uint64_t> hashes;
+        vector<double> negw;
+    };
+
+    fast_hrw::kernel_type kernel_;
+    const char *kernel_name_;
+    vector<string> names_;
+    // the clusters at depth 1 first, the leaves last
+    vector<Level> levels_;
+    // the nodes of leaf c are members_[begins_[c], begins_[c + 1])
+    vector<size_t> begins_;
+    vector<int> members_;
+    vector<uint64_t> member_hashes_;
+    vector<double> member_negw_;
+};
+
+// The node of a key is the HRW winner of its slot, one of N; a slot is scored against
+// all nodes once, by the fast_hrw kernel, and the winner kept in the table. The kernel's
+// logarithm is approximate, so where two nodes nearly tie a slot can go to another node
+// than HRWHash would pick: with weights 1 to 8, 2 of 65536 slots at 50 nodes and 14 at
+// 500, none with equal weights. Slots fill lazily on first use, from any thread: the
+// winner depends only on the nodes, so threads racing on an empty slot store the same
+// value and a relaxed atomic is all publication takes. With eager set, init instead
+// fills the whole table up front, the slots split over nthreads threads (0 picks one per
+// 4096 slots, up to the number of CPUs), so that no lookup pays the O(nodes) first touch.
+template <int N = 65536> class YHash : public Hash {
+public:
+    YHash(hash_func_type hash = murmur_hash2, bool eager = false, unsigned nthreads = 0)
+        : Hash(hash)
+        , eager_(eager)
+        , nthreads_(nthreads)
+    {
+    }
+
+    // for RcuHash, which updates a copy
+    YHash(const YHash &o)
+        : Hash(o.hash_)
+        , eager_(o.eager_)
+        , nthreads_(o.nthreads_)
+        , hrw_(o.hrw_)
+        , nodes_(o.nodes_)
+    {
+        for (int k = 0; k < N; k++) {
+            table_[k].store(o.table_[k].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+    void init(vector<tuple<string, int>> nodes) override
+    {
+        nodes_.clear();
+        for (auto &slot : table_) {
+            slot.store(0, std::memory_order_relaxed);
+        }
+
+        for (auto &node : nodes) {
+            nodes_.emplace_back(std::get<0>(node), 0, std::get<1>(node));
+        }
+
+        hrw_.init(nodes);
+        if (eager_ && !nodes_.empty()) {
+            build();
+        }
+    }
+
+    string_view get(const string &key) override
+    {
+        int index = YHash::get_index(key);
+        if (index < 0) {
+            return "";
+        }
+        return nodes_[index].name;
+    }
+
+    int get_index(const string &key) override { return slot(hash_(key) % N); }
+
+    // slots of the whole chunk are prefetched before any is read
+    void get_batch(const string *keys, size_t n, int *out) override
+    {
+        uint32_t ks[kBatch];
+        for (size_t base = 0; base < n; base += kBatch) {
+            size_t m = std::min(kBatch, n - base);
+            for (size_t j = 0; j < m; j++) {
+                ks[j] = hash_(keys[base + j]) % N;
+                __builtin_prefetch(&table_[ks[j]]);
+            }
+            for (size_t j = 0; j < m; j++) {
+                out[base + j] = slot(ks[j]);
+            }
+        }
+    }
+
+    string name() const override
+    {
+        if (!eager_) {
+            return string(type_name<decltype(*this)>());
+        }
+        return string(type_name<decltype(*this)>()) + "(eager"
+            + (nthreads_ > 0 ? ", " + to_string(nthreads_) + " threads)" : ")");
+    }
+
+    size_t memory() const override { return sizeof(table_); }
+
+private:
+    // the node of slot k, picked by HRW on first use; the table holds index + 1
+    int slot(uint32_t k)
+    {
+        int idx = table_[k].load(std::memory_order_relaxed);
+        if (idx == 0) {
+            idx = hrw_.get_index(to_string(k)) + 1;
+            table_[k].store(idx, std::memory_order_relaxed);
+        }
+        return idx - 1;
+    }
+
+    void build()
+    {
+        unsigned nthreads = nthreads_;
+        if (nthreads == 0) {
+            nthreads = std::min<unsigned>(std::thread::hardware_concurrency(), N / 4096);
+        }
+        nthreads = std::max(1u, std::min<unsigned>(nthreads, N));
+
+        auto fill = [this, nthreads](unsigned t) {
+            for (int k = (int64_t)N * t / nthreads; k < (int64_t)N * (t + 1) / nthreads; k++) {
+                table_[k].store(hrw_.get_index(to_string(k)) + 1, std::memory_order_relaxed);
+            }
+        };
+        vector<std::thread> threads;
+        for (unsigned t = 1; t < nthreads; t++) {
+            threads.emplace_back(fill, t);
+        }
+        fill(0);
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+private:
+    bool eager_;
+    unsigned nthreads_;
+    FastHRWHash hrw_;
+    std::atomic<int> table_[N];
+    vector<Node> nodes_;
+};
+
+const static uint32_t fleaSeed = 0xf1ea5eed;
+const static uint32_t fleaRot1 = 27;
+const static uint32_t fleaRot2 = 17;
+const static uint32_t fleaInitRounds = 3;
+
+tuple<uint32_t, uint32_t, uint32_t, uint32_t> flea_init(uint64_t key)
+{
+    uint32_t seed = uint32_t((key >> 32) ^ key);
+    uint32_t a = fleaSeed;
+    uint32_t b = seed;
+    uint32_t c = seed;
+    uint32_t d = seed;
+
+    for (uint32_t i = 0; i < fleaInitRounds; i++) {
+        uint32_t e = a - (b << fleaRot1);
+        a = b ^ (c << fleaRot2);
+        b = c + d;
+        c = d + e;
+        d = e + a;
+    }
+
+    return { a, b, c, d };
+    // return make_tuple(a, b, c, d);
+}
+
+tuple<uint32_t, uint32_t, uint32_t, uint32_t> flea_round(
+    tuple<uint32_t, uint32_t, uint32_t, uint32_t> abcd)
+{
+    auto [a, b, c, d] = abcd;
+    uint32_t e = a - (b << fleaRot1);
+    a = b ^ (c << fleaRot2);
+    b = c + d;
+    c = d + e;
+    d = e + a;
+    return { a, b, c, d };
+}
+
+// fastrange: x scaled into [0, n), a multiply instead of a division
+static inline uint32_t reduce32(uint32_t x, uint32_t n)
+{
+    return (uint64_t)x * n >> 32;
+}
+
+// The compact AnchorHash of Mendelson et al. over a fixed capacity of buckets. A[b] is 0
+// while b works, and the number of buckets left working right after b was removed
+// otherwise; a key that lands on a removed bucket rehashes among the buckets that were
+// working before it, following K to the one that replaced a bucket removed since. W and
+// L keep the working buckets in a dense array, R stacks the removed ones, so that the
+// last removed is the first added back. Removing and adding a bucket is O(1) and moves
+// only the keys of that bucket. Bucket is uint16_t for the most compact arrays, up to
+// 65536 buckets, or uint32_t past that.
+template <typename Bucket> class CompactAnchor {
+public:
+    CompactAnchor(size_t capacity, size_t working)
+        : A(capacity, 0)
+        , K(capacity)
+        , W(capacity)
+        , L(capacity)
+        , N(working)
+    {
+        if (capacity == 0 || capacity - 1 > std::numeric_limits<Bucket>::max()
+            || working > capacity) {
+            log_fatal("%lu buckets do not fit %s", capacity, string(type_name<Bucket>()).data());
+        }
+        for (size_t b = 0; b < capacity; b++) {
+            K[b] = b;
+            W[b] = b;
+            L[b] = b;
+        }
+        for (size_t b = capacity; b-- > working;) {
+            R.push_back(b);
+            A[b] = b;
+        }
+    }
+
+    Bucket get_bucket(uint64_t key) const
+    {
+        auto [ha, hb, hc, hd] = flea_init(key);
+        Bucket b = reduce32(hd, A.size());
+        while (A[b] > 0) {
+            auto [ha2, hb2, hc2, hd2] = flea_round({ ha, hb, hc, hd });
+            ha = ha2;
+            hb = hb2;
+            hc = hc2;
+            hd = hd2;
+            Bucket h = reduce32(hd, A[b]);
+            while (A[h] >= A[b]) {
+                h = K[h];
+            }
+            b = h;
+        }
+        return b;
+    }
+
+    // the bucket removed last, working again; the caller checks that one is left
+    Bucket add_bucket()
+    {
+        Bucket b = R.back();
+        R.pop_back();
+        A[b] = 0;
+        L[W[N]] = N;
+        W[L[b]] = b;
+        K[b] = b;
+        N++;
+        return b;
+    }
+
+    void remove_bucket(Bucket b)
+    {
+        R.push_back(b);
+        N--;
+        A[b] = N;
+        W[L[b]] = W[N];
+        K[b] = W[N];
+        L[W[N]] = L[b];
+    }
+
+    // A[b] is N after the removal, so the bucket removed last when none is left has
+    // A[b] == 0 too; it is the first add_bucket gives back
+    bool is_working(Bucket b) const { return N > 0 && A[b] == 0; }
+    size_t capacity() const { return A.size(); }
+    size_t working() const { return N; }
+
+    size_t memory() const
+    {
+        return (A.capacity() + K.capacity() + W.capacity() + L.capacity() + R.capacity())
+            * sizeof(Bucket);
+    }
+
+private:
+    vector<Bucket> A;
+    vector<Bucket> K;
+    vector<Bucket> W;
+    vector<Bucket> L;
+    vector<Bucket> R;
+    size_t N;
+};
+
+// Nodes on CompactAnchor buckets, weights ignored. init diffs the nodes against the last
+// ones: the buckets of nodes that left are removed, new nodes take removed buckets back,
+// so a membership change only moves the keys it has to. The capacity is fixed on the
+// first init, the larger of capacity and the node count, and a list that outgrows it
+// starts over on a larger anchor. Spare capacity is not free: a key that lands on a
+// removed bucket rehashes, about ln(capacity / working) times on average.
+template <typename Bucket = uint32_t> class AnchorHash : public Hash {
+public:
+    AnchorHash(hash_func_type hash = murmur_hash2, size_t capacity = 0)
+        : Hash(hash)
+        , capacity_(capacity)
+    {
+    }
+
+    void init(vector<tuple<string, int>> nodes) override
+    {
+        unordered_map<string, int> index;
+        for (int i = 0; i < nodes.size(); i++) {
+            index.emplace(std::get<0>(nodes[i]), i);
+        }
+        if (index.size() != nodes.size()) {
+            log_fatal("duplicate node names");
+        }
+
+        if (!anchor_ || nodes.size() > anchor_->capacity()) {
+            size_t capacity = std::max({ capacity_, nodes.size(), (size_t)1 });
+            anchor_ = make_unique<CompactAnchor<Bucket>>(capacity, nodes.size());
+            buckets_.assign(capacity, "");
+            for (int i = 0; i < nodes.size(); i++) {
+                buckets_[i] = std::get<0>(nodes[i]);
+            }
+        } else {
+            // removed from the top, so that nodes coming back in list order take back the
+            // buckets they had
+            std::unordered_set<string> kept;
+            for (size_t b = buckets_.size(); b-- > 0;) {
+                if (!anchor_->is_working(b)) {
+                    continue;
+                }
+                if (index.count(buckets_[b])) {
+                    kept.insert(buckets_[b]);
+                } else {
+                    anchor_->remove_bucket(b);
+                    buckets_[b].clear();
+                }
+            }
+            for (const auto &node : nodes) {
+                if (!kept.count(std::get<0>(node))) {
+                    buckets_[anchor_->add_bucket()] = std::get<0>(node);
+                }
+            }
+        }
+
+        owners_.assign(buckets_.size(), -1);
+        for (size_t b = 0; b < buckets_.size(); b++) {
+            if (anchor_->is_working(b)) {
+                owners_[b] = index[buckets_[b]];
+            }
+        }
+        names_.clear();
+        for (const auto &node : nodes) {
+            names_.push_back(std::get<0>(node));
+        }
+    }
+
+    string_view get(const string &key) override
+    {
+        int index = AnchorHash::get_index(key);
+        if (index < 0) {
+            return "";
+        }
+        return names_[index];
+    }
+
+    int get_index(const string &key) override
+    {
+        if (names_.empty()) {
+            return -1;
+        }
+        return owners_[anchor_->get_bucket(hash_(key))];
+    }
+
+    void get_batch(const string *keys, size_t n, int *out) override
+    {
+        if (names_.empty()) {
+            std::fill(out, out + n, -1);
+            return;
+        }
+
+        uint32_t hs[kBatch];
+        for (size_t base = 0; base < n; base += kBatch) {
+            size_t m = std::min(kBatch, n - base);
+            for (size_t j = 0; j < m; j++) {
+                hs[j] = hash_(keys[base + j]);
+            }
+            for (size_t j = 0; j < m; j++) {
+                out[base + j] = owners_[anchor_->get_bucket(hs[j])];
+            }
+        }
+    }
+
+    size_t memory() const override
+    {
+        return anchor_ ? anchor_->memory() + owners_.capacity() * sizeof(int) : 0;
+    }
+
+    string name() const override { return string(type_name<decltype(*this)>()); }
+
+private:
+    size_t capacity_;
+    unique_ptr<CompactAnchor<Bucket>> anchor_;
+    // the node on each bucket, empty for removed buckets
+    vector<string> buckets_;
+    // bucket -> position of its node in the last init
+    vector<int> owners_;
+    vector<string> names_;
+};
+
+// Jump consistent hash (Lamping and Veach): no table, a key follows the jumps it would
+// make as buckets are appended one by one. Only the last bucket can go or come without
+// moving other keys, so a node is a run of weight buckets, and any change but to the last
+// node shifts the runs after it.
+class JumpHash : public Hash {
+public:
+    JumpHash()
+        : Hash(murmur_hash2)
+    {
+    }
+
+    void init(vector<tuple<string, int>> nodes) override
+    {
+        names_.clear();
+        buckets_.clear();
+        for (int i = 0; i < nodes.size(); i++) {
+            names_.push_back(std::get<0>(nodes[i]));
+            buckets_.insert(buckets_.end(), std::get<1>(nodes[i]), i);
+        }
+    }
+
+    string_view get(const string &key) override
+    {
+        int index = JumpHash::get_index(key);
+        if (index < 0) {
+            return "";
+        }
+        return names_[index];
+    }
+
+    int get_index(const string &key) override
+    {
+        if (buckets_.empty()) {
+            return -1;
+        }
+        return buckets_[jump(hash64(key), buckets_.size())];
+    }
+
+    void get_batch(const string *keys, size_t n, int *out) override
+    {
+        if (buckets_.empty()) {
+            std::fill(out, out + n, -1);
+            return;
+        }
+
+        uint64_t khashes[kBatch];
+        for (size_t base = 0; base < n; base += kBatch) {
+            size_t m = std::min(kBatch, n - base);
+            for (size_t j = 0; j < m; j++) {
+                khashes[j] = hash64(keys[base + j]);
+            }
+            for (size_t j = 0; j < m; j++) {
+                out[base + j] = buckets_[jump(khashes[j], buckets_.size())];
+            }
+        }
+    }
+
+    string name() const override { return string(type_name<decltype(*this)>()); }
+
+    size_t memory() const override { return buckets_.capacity() * sizeof(int); }
+
+private:
+    static int32_t jump(uint64_t key, int32_t num_buckets)
+    {
+        int64_t b = -1;
+        int64_t j = 0;
+        while (j < num_buckets) {
+            b = j;
+            key = key * 2862933555777941757ULL + 1;
+            j = (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+        }
+        return b;
+    }
+
+    vector<string> names_;
+    // bucket -> node
+    vector<int> buckets_;
+};
+
+// Maglev (Eisenbud et al.): each node walks its own permutation of a prime-sized table,
+// offset + j * skip mod M, and the nodes take turns claiming the next free entry on
+// theirs until the table is full; a lookup is one table read. Turns are weighted: every
+// round a node earns its weight and claims an entry per max weight earned, so nodes get
+// entries in proportion. A node change also moves a few entries that were not its own,
+// fewer the larger M is against the node count.
+class MaglevHash : public Hash {
+public:
+    MaglevHash(uint32_t table_size = 65537)
+        : Hash(murmur_hash2)
+        , table_size_(table_size)
+    {
+        if (table_size < 2) {
+            log_fatal("maglev table size %u is not a prime", table_size);
+        }
+        for (uint32_t d = 2; (uint64_t)d * d <= table_size; d++) {
+            if (table_size % d == 0) {
+                log_fatal("maglev table size %u is not a prime", table_size);
+            }
+        }
+    }
+
+    void init(vector<tuple<string, int>> nodes) override
+    {
+        names_.clear();
+        table_.clear();
+        int max_weight = 0;
+        for (const auto &node : nodes) {
+            names_.push_back(std::get<0>(node));
+            max_weight = std::max(max_weight, std::get<1>(node));
+        }
+        if (max_weight <= 0) {
+            return;
+        }
+
+        const uint32_t m = table_size_;
+        vector<uint32_t> next(nodes.size());
+        vector<uint32_t> skip(nodes.size());
+        vector<int> credit(nodes.size(), 0);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            next[i] = hash64(names_[i]) % m;
+            skip[i] = hash64(names_[i] + ":skip") % (m - 1) + 1;
+        }
+
+        table_.assign(m, -1);
+        uint32_t filled = 0;
+        while (filled < m) {
+            for (size_t i = 0; i < nodes.size() && filled < m; i++) {
+                credit[i] += std::get<1>(nodes[i]);
+                for (; credit[i] >= max_weight && filled < m; credit[i] -= max_weight) {
+                    while (table_[next[i]] >= 0) {
+                        next[i] = (next[i] + skip[i]) % m;
+                    }
+                    table_[next[i]] = i;
+                    next[i] = (next[i] + skip[i]) % m;
+                    filled++;
+                }
+            }
+        }
+    }
+
+    string_view get(const string &key) override
+    {
+        int index = MaglevHash::get_index(key);
+        if (index < 0) {
+            return "";
+        }
+        return names_[index];
+    }
+
+    int get_index(const string &key) override
+    {
+        if (table_.empty()) {
+            return -1;
+        }
+        return table_[reduce32(hash64(key), table_size_)];
+    }
+
+    void get_batch(const string *keys, size_t n, int *out) override
+    {
+        if (table_.empty()) {
+            std::fill(out, out + n, -1);
+            return;
+        }
+
+        uint32_t slots[kBatch];
+        for (size_t base = 0; base < n; base += kBatch) {
+            size_t m = std::min(kBatch, n - base);
+            for (size_t j = 0; j < m; j++) {
+                slots[j] = reduce32(hash64(keys[base + j]), table_size_);
+                __builtin_prefetch(&table_[slots[j]]);
+            }
+            for (size_t j = 0; j < m; j++) {
+                out[base + j] = table_[slots[j]];
+            }
+        }
+    }
+
+    string name() const override
+    {
+        return string(type_name<decltype(*this)>()) + "(" + to_string(table_size_) + ")";
+    }
+
+    size_t memory() const override { return table_.capacity() * sizeof(int); }
+
+private:
+    uint32_t table_size_;
+    vector<string> names_;
+    // entry -> node
+    vector<int> table_;
+};
+
+// Multi-probe consistent hashing (Appleton and O'Reilly): a point on a 64-bit ring per
+// node and weight unit, no vnodes, and a key hashed probes times; the key goes to the
+// point that follows one of its probes most closely. 21 probes bring the peak load to
+// about 1.05 of the mean, for a binary search per probe.
+class MultiProbeHash : public Hash {
+public:
+    MultiProbeHash(int probes = 21)
+        : Hash(murmur_hash2)
+        , probes_(probes)
+    {
+        if (probes < 1) {
+            log_fatal("multi-probe count %d is not positive", probes);
+        }
+    }
+
+    void init(vector<tuple<string, int>> nodes) override
+    {
+        names_.clear();
+        vector<tuple<uint64_t, int>> points;
+        for (int i = 0; i < nodes.size(); i++) {
+            const string &name = std::get<0>(nodes[i]);
+            names_.push_back(name);
+            for (int j = 0; j < std::get<1>(nodes[i]); j++) {
+                points.emplace_back(hash64(name + "#" + to_string(j)), i);
+            }
+        }
+        sort(points.begin(), points.end());
+
+        points_.clear();
+        owners_.clear();
+        for (const auto &point : points) {
+            points_.push_back(std::get<0>(point));
+            owners_.push_back(std::get<1>(point));
+        }
+    }
+
+    string_view get(const string &key) override
+    {
+        int index = MultiProbeHash::get_index(key);
+        if (index < 0) {
+            return "";
+        }
+        return names_[index];
+    }
+
+    int get_index(const string &key) override
+    {
+        if (points_.empty()) {
+            return -1;
+        }
+
+        uint64_t h = hash64(key);
+        uint64_t min_distance = UINT64_MAX;
+        size_t closest = 0;
+        for (int p = 0; p < probes_; p++) {
+            uint64_t probe = fmix64(h + p * 0x9E3779B97F4A7C15ULL);
+            // lower_bound without branches, the probes are random and a branch per step
+            // would miss half the time
+            size_t i = 0;
+            for (size_t len = points_.size(); len > 1; len -= len / 2) {
+                i += (points_[i + len / 2 - 1] < probe) * (len / 2);
+            }
+            i += points_[i] < probe;
+            i = i == points_.size() ? 0 : i;
+            // unsigned, so the distance wraps around the ring
+            uint64_t distance = points_[i] - probe;
+            closest = distance < min_distance ? i : closest;
+            min_distance = std::min(distance, min_distance);
+        }
+        return owners_[closest];
+    }
+
+    string name() const override { return string(type_name<decltype(*this)>()); }
+
+    size_t memory() const override
+    {
+        return points_.capacity() * sizeof(uint64_t) + owners_.capacity() * sizeof(int);
+    }
+
+private:
+    int probes_;
+    vector<string> names_;
+    vector<uint64_t> points_;
+    vector<int> owners_;
+};
+
+// A small index per thread, handed out on first use and given back when the thread
+// exits, so that short-lived threads do not use up the slots of an EpochDomain.
+class ThreadSlot {
+public:
+    static constexpr int kMaxThreads = 256;
+
+    static int get()
+    {
+        thread_local ThreadSlot slot;
+        return slot.index_;
+    }
+
+private:
+    ThreadSlot()
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (!free_list().empty()) {
+            index_ = free_list().back();
+            free_list().pop_back();
+        } else {
+            index_ = next()++;
+        }
+        if (index_ >= kMaxThreads) {
+            log_fatal("more than %d threads", kMaxThreads);
+        }
+    }
+
+    ~ThreadSlot()
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        free_list().push_back(index_);
+    }
+
+    static std::mutex &mutex()
+    {
+        static std::mutex m;
+        return m;
+    }
+
+    static vector<int> &free_list()
+    {
+        static vector<int> v;
+        return v;
+    }
+
+    static int &next()
+    {
+        static int n = 0;
+        return n;
+    }
+
+    int index_;
+};
+
+// Epoch-based reclamation for one writer at a time. A reader pins the global epoch in
+// its thread's slot for the length of an access; an object the writer unlinked in epoch
+// e is freed once every pinned slot is past e. Everything is seq_cst: a reader that
+// pinned after the unlink is then also ordered after it, and cannot load the old
+// pointer. Pins do not nest.
+class EpochDomain {
+public:
+    class Guard {
+    public:
+        explicit Guard(std::atomic<uint64_t> *slot)
+            : slot_(slot)
+        {
+        }
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+        ~Guard() { slot_->store(0, std::memory_order_release); }
+
+    private:
+        std::atomic<uint64_t> *slot_;
+    };
+
+    ~EpochDomain()
+    {
+        for (auto &retired : retired_) {
+            std::get<1>(retired)();
+        }
+    }
+
+    Guard pin()
+    {
+        std::atomic<uint64_t> &slot = slots_[ThreadSlot::get()].epoch;
+        slot.store(epoch_.load());
+        return Guard(&slot);
+    }
+
+    // free runs once no reader can still hold what the caller just unlinked
+    void retire(std::function<void()> free)
+    {
+        retired_.emplace_back(epoch_.fetch_add(1), std::move(free));
+        collect();
+    }
+
+    void collect()
+    {
+        uint64_t min = UINT64_MAX;
+        for (const auto &slot : slots_) {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch != 0) {
+                min = std::min(min, epoch);
+            }
+        }
+
+        size_t kept = 0;
+        for (auto &retired : retired_) {
+            if (std::get<0>(retired) < min) {
+                std::get<1>(retired)();
+            } else {
+                retired_[kept++] = std::move(retired);
+            }
+        }
+        retired_.resize(kept);
     }
 
-    string name() const override { return get_filt_type_name<decltype(*this)>(); }
+    size_t retired() const { return retired_.size(); }
 
 private:
-    uint64_t xorshiftmul64(uint64_t x)
-    {
-        x ^= x >> 12;
-        x ^= x << 25;
-        x ^= x >> 27;
-        return x * 2685821657736338717;
-    }
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch { 0 };
+    };
 
-private:
-    vector<Node> nodes_;
+    // 0 marks an idle slot
+    std::atomic<uint64_t> epoch_ { 1 };
+    Slot slots_[ThreadSlot::kMaxThreads];
+    vector<tuple<uint64_t, std::function<void()>>> retired_;
 };
 
-template <int N = 65536> class YHash : public Hash {
+// H behind an atomic pointer, RCU style: init copies the current table, updates the copy
+// off to the side (so CHash still rebuilds incrementally) and swaps it in; lookups on
+// any thread go on with the table they loaded and never wait for init. H must be safe
+// for concurrent lookups and copyable. Node names are interned and never freed, so what
+// get returns outlives the table it came from.
+template <typename H> class RcuHash : public Hash {
 public:
-    YHash(hash_func_type hash = murmur_hash2)
-        : Hash(hash)
+    explicit RcuHash(H prototype = H())
+        : Hash(murmur_hash2)
+        , prototype_(std::move(prototype))
     {
     }
 
+    ~RcuHash() { delete current_.load(); }
+
     void init(vector<tuple<string, int>> nodes) override
     {
-        nodes_.clear();
-        memset(table_, 0, sizeof(table_));
-        index_map_.clear();
-
-        for (auto &node : nodes) {
-            nodes_.emplace_back(std::get<0>(node), 0, std::get<1>(node));
-            index_map_[std::get<0>(node)] = nodes_.size() - 1;
+        std::lock_guard<std::mutex> lock(mutex_);
+        Table *old = current_.load(std::memory_order_relaxed);
+        auto table = make_unique<Table>(old ? old->hash : prototype_);
+        for (const auto &node : nodes) {
+            table->names.emplace_back(*names_.insert(std::get<0>(node)).first);
         }
+        table->hash.init(std::move(nodes));
 
-        hrw_.init(nodes);
+        current_.store(table.release());
+        if (old) {
+            epoch_.retire([old] { delete old; });
+        }
     }
 
-    string get(const string &key) override
+    string_view get(const string &key) override
     {
-        int k = hash_(key) % array_size(table_);
-        int idx = table_[k];
-        if (idx == 0) {
-            auto s = hrw_.get(to_string(k));
-            table_[k] = index_map_[s] + 1;
-            idx = table_[k];
-        }
-        return nodes_[--idx].name;
+        auto guard = epoch_.pin();
+        Table *table = current_.load();
+        int index = table ? table->hash.get_index(key) : -1;
+        return index < 0 ? string_view() : table->names[index];
     }
 
-    string name() const override { return get_filt_type_name<decltype(*this)>(); }
-
-private:
-    HRWHash hrw_;
-    int table_[N];
-    vector<Node> nodes_;
-    unordered_map<string, int> index_map_;
-};
-
-const static uint32_t fleaSeed = 0xf1ea5eed;
-const static uint32_t fleaRot1 = 27;
-const static uint32_t fleaRot2 = 17;
-const static uint32_t fleaInitRounds = 3;
-
-tuple<uint32_t, uint32_t, uint32_t, uint32_t> flea_init(uint64_t key)
-{
-    uint32_t seed = uint32_t((key >> 32) ^ key);
-    uint32_t a = fleaSeed;
-    uint32_t b = seed;
-    uint32_t c = seed;
-    uint32_t d = seed;
-
-    for (uint32_t i = 0; i < fleaInitRounds; i++) {
-        uint32_t e = a - (b << fleaRot1);
-        a = b ^ (c << fleaRot2);
-        b = c + d;
-        c = d + e;
-        d = e + a;
+    int get_index(const string &key) override
+    {
+        auto guard = epoch_.pin();
+        Table *table = current_.load();
+        return table ? table->hash.get_index(key) : -1;
     }
 
-    return { a, b, c, d };
-    // return make_tuple(a, b, c, d);
-}
-
-tuple<uint32_t, uint32_t, uint32_t, uint32_t> flea_round(
-    tuple<uint32_t, uint32_t, uint32_t, uint32_t> abcd)
-{
-    auto [a, b, c, d] = abcd;
-    uint32_t e = a - (b << fleaRot1);
-    a = b ^ (c << fleaRot2);
-    b = c + d;
-    c = d + e;
-    d = e + a;
-    return { a, b, c, d };
-}
-
-class CompactAnchor {
-public:
-    CompactAnchor(int cap)
-        : A(cap, 0)
-        , K(cap, 0)
-        , W(cap, 0)
-        , L(cap, 0)
-        , R(cap, 0)
-        , N(cap)
+    void get_batch(const string *keys, size_t n, int *out) override
     {
-        for (int i = 0; i < cap; i++) {
-            K[i] = i;
-            W[i] = i;
-            L[i] = i;
+        auto guard = epoch_.pin();
+        Table *table = current_.load();
+        if (table) {
+            table->hash.get_batch(keys, n, out);
+        } else {
+            std::fill(out, out + n, -1);
         }
     }
 
-    uint16_t get_bucket(uint64_t key)
+    string name() const override { return string(type_name<decltype(*this)>()); }
+
+    // tables swapped out but not freed yet
+    size_t retired()
     {
-        auto [ha, hb, hc, hd] = flea_init(key);
-        uint16_t b = hd % A.size();
-        while (A[b] > 0) {
-            auto [ha2, hb2, hc2, hd2] = flea_round({ ha, hb, hc, hd });
-            ha = ha2;
-            hb = hb2;
-            hc = hc2;
-            hd = hd2;
-            uint16_t h = hd % A[b];
-            while (A[h] >= A[b]) {
-                h = K[h];
-            }
-            b = h;
-        }
-        return b;
+        std::lock_guard<std::mutex> lock(mutex_);
+        return epoch_.retired();
     }
 
 private:
-    vector<uint16_t> A;
-    vector<uint16_t> K;
-    vector<uint16_t> W;
-    vector<uint16_t> L;
-    vector<uint16_t> R;
-    int N;
+    struct Table {
+        explicit Table(const H &h)
+            : hash(h)
+        {
+        }
+
+        H hash;
+        vector<string_view> names;
+    };
+
+    std::mutex mutex_;
+    H prototype_;
+    std::unordered_set<string> names_;
+    std::atomic<Table *> current_ { nullptr };
+    EpochDomain epoch_;
 };
 
-class AnchorHash : public Hash {
+// what readers do without RcuHash: share a lock that init takes exclusively while it
+// updates the table in place
+template <typename H> class LockedHash : public Hash {
 public:
-    AnchorHash(hash_func_type hash = murmur_hash2)
-        : Hash(hash)
+    explicit LockedHash(H hash = H())
+        : Hash(murmur_hash2)
+        , hash_(std::move(hash))
     {
     }
 
     void init(vector<tuple<string, int>> nodes) override
     {
-        anchor_ = make_unique<CompactAnchor>(nodes.size());
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        hash_.init(std::move(nodes));
+    }
 
-        std::transform(nodes.cbegin(), nodes.cend(), std::back_inserter(nodes_),
-            [](const tuple<string, int> &node) {
-                const auto name = std::get<0>(node);
-                return name;
-            });
+    string_view get(const string &key) override
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return hash_.get(key);
+    }
+
+    int get_index(const string &key) override
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return hash_.get_index(key);
     }
 
-    string get(const string &key) override { return nodes_[anchor_->get_bucket(hash_(key))]; }
+    void get_batch(const string *keys, size_t n, int *out) override
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        hash_.get_batch(keys, n, out);
+    }
 
-    string name() const override { return get_filt_type_name<decltype(*this)>(); }
+    string name() const override { return string(type_name<decltype(*this)>()); }
 
 private:
-    unique_ptr<CompactAnchor> anchor_;
-    vector<string> nodes_;
+    std::shared_mutex mutex_;
+    H hash_;
 };
 
 string get_random_string()
@@ -484,6 +2166,21 @@ vector<string> get_sequential_string_array(int num)
     return ret;
 }
 
+// nodes 127.0.0.1 up to 127.0.0.<count>, node i weighing weight(i)
+vector<tuple<string, int>> make_nodes(int count, const std::function<int(int)> &weight)
+{
+    vector<tuple<string, int>> nodes;
+    for (int i = 0; i < count; i++) {
+        nodes.emplace_back(make_tuple("127.0.0." + to_string(i + 1), weight(i)));
+    }
+    return nodes;
+}
+
+vector<tuple<string, int>> make_nodes(int count, int weight)
+{
+    return make_nodes(count, [weight](int) { return weight; });
+}
+
 vector<string> get_random_string_array(int num)
 {
     vector<string> ret;
@@ -572,14 +2269,38 @@ void check_consistency_2()
     do_compare_results(results1, results4);
 }
 
+// one node out of node_count removed, the first, one in the middle and the last: the keys
+// of the other nodes must stay, 1 - 1 / node_count of all keys
+void check_remove_node(shared_ptr<Hash> hash, int node_count)
+{
+    vector<string> strs = get_sequential_string_array(100000);
+    vector<tuple<string, int>> nodes = make_nodes(node_count, 1);
+    hash->init(nodes);
+    vector<int> before;
+    for (const auto &str : strs) {
+        before.push_back(hash->get_index(str));
+    }
+
+    for (int victim : { 0, node_count / 2, node_count - 1 }) {
+        vector<tuple<string, int>> rest = nodes;
+        rest.erase(rest.begin() + victim);
+        hash->init(rest);
+        size_t same = 0;
+        for (size_t k = 0; k < strs.size(); k++) {
+            int index = hash->get_index(strs[k]);
+            same += before[k] != victim && index == before[k] - (before[k] > victim);
+        }
+        log_info("%s, node_count = %d, remove %d, kept %.01f%%, ideal %.01f%%",
+            hash->name().data(), node_count, victim, same * 100.0 / strs.size(),
+            100.0 - 100.0 / node_count);
+    }
+}
+
 void bench_hash(shared_ptr<Hash> hash, vector<string> strs, int node_count)
 {
     string name = hash->name() + ":node_count=" + to_string(node_count);
 
-    vector<tuple<string, int>> nodes;
-    for (int i = 0; i < node_count; i++) {
-        nodes.emplace_back(make_tuple("127.0.0." + to_string(i + 1), 5));
-    }
+    vector<tuple<string, int>> nodes = make_nodes(node_count, 5);
 
     struct timeval tv_start = tv_now();
     hash->init(nodes);
@@ -595,8 +2316,418 @@ void bench_hash(shared_ptr<Hash> hash, vector<string> strs, int node_count)
     tv_end = tv_now();
 
     ms_taken = tv_sub_msec_double(tv_end, tv_start);
-    log_info("%s count=%lu taken %.02fms, %.02fus/op", name.data(), strs.size(), ms_taken,
-        ms_taken * 1000 / strs.size());
+    log_info("%s count=%lu taken %.02fms, %.02fus/op, %.02fM lookups/s", name.data(), strs.size(),
+        ms_taken, ms_taken * 1000 / strs.size(), strs.size() / ms_taken / 1000);
+}
+
+// the same lookups through get_batch, batch keys per call
+void bench_hash_batch(shared_ptr<Hash> hash, vector<string> strs, int node_count, size_t batch)
+{
+    string name = hash->name() + ":node_count=" + to_string(node_count) + ",batch="
+        + to_string(batch);
+
+    vector<tuple<string, int>> nodes = make_nodes(node_count, 5);
+    hash->init(nodes);
+
+    vector<int> out(strs.size());
+    struct timeval tv_start = tv_now();
+    for (size_t i = 0; i < strs.size(); i += batch) {
+        hash->get_batch(&strs[i], std::min(batch, strs.size() - i), &out[i]);
+    }
+    struct timeval tv_end = tv_now();
+
+    double ms_taken = tv_sub_msec_double(tv_end, tv_start);
+    log_info("%s count=%lu taken %.02fms, %.02fus/op, %.02fM lookups/s", name.data(), strs.size(),
+        ms_taken, ms_taken * 1000 / strs.size(), strs.size() / ms_taken / 1000);
+
+    size_t diff = 0;
+    for (size_t i = 0; i < strs.size(); i++) {
+        diff += out[i] != hash->get_index(strs[i]);
+    }
+    if (diff > 0) {
+        log_info("%s: %lu of %lu differ from get_index", name.data(), diff, strs.size());
+    }
+}
+
+void bench_batch(vector<shared_ptr<Hash>> hashs, int count, size_t batch)
+{
+    vector<string> strs = get_sequential_string_array(count);
+    for (const auto &hash : hashs) {
+        for (int node_count : { 5, 50, 100, 250, 500 }) {
+            bench_hash(hash, strs, node_count);
+            bench_hash_batch(hash, strs, node_count, batch);
+        }
+    }
+}
+
+// what an L4 balancer weighs: table build time, lookup structure size and get_index cost,
+// node counts ascending so that every init is a full build
+void bench_lb(vector<shared_ptr<Hash>> hashs, int count)
+{
+    vector<string> strs = get_sequential_string_array(count);
+    for (const auto &hash : hashs) {
+        for (int node_count : { 5, 50, 500 }) {
+            vector<tuple<string, int>> nodes = make_nodes(node_count, 5);
+
+            struct timeval tv_start = tv_now();
+            hash->init(nodes);
+            double build_ms = tv_sub_msec_double(tv_now(), tv_start);
+
+            int sum = 0;
+            tv_start = tv_now();
+            for (const auto &str : strs) {
+                sum += hash->get_index(str);
+            }
+            double lookup_ms = tv_sub_msec_double(tv_now(), tv_start);
+
+            log_info("%s:node_count=%d build %.02fms, memory %.1fKB, %.1fns/op (%d)",
+                hash->name().data(), node_count, build_ms, hash->memory() / 1024.0,
+                lookup_ms * 1e6 / strs.size(), sum & 1);
+        }
+    }
+}
+
+// every fast_hrw kernel the CPU has must pick the node the scalar one picks
+void check_hrw_kernels(int count)
+{
+    vector<string> strs = get_sequential_string_array(count);
+    vector<fast_hrw::Kernel> kernels = { fast_hrw::Kernel::scalar };
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(fast_hrw::Kernel::avx2);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back(fast_hrw::Kernel::avx512);
+    }
+
+    for (int node_count : { 1, 5, 13, 50, 500 }) {
+        vector<tuple<string, int>> nodes = make_nodes(node_count, [](int i) { return 1 + i % 7; });
+
+        vector<vector<int>> results;
+        for (auto kernel : kernels) {
+            FastHRWHash hash(kernel);
+            hash.init(nodes);
+            results.emplace_back(strs.size());
+            hash.get_batch(strs.data(), strs.size(), results.back().data());
+        }
+        for (size_t k = 1; k < kernels.size(); k++) {
+            size_t same = 0;
+            for (size_t i = 0; i < strs.size(); i++) {
+                same += results[k][i] == results[0][i];
+            }
+            log_info("fast_hrw kernel %d vs scalar, node_count = %d, same is %lu of %lu", (int)k,
+                node_count, same, strs.size());
+        }
+    }
+}
+
+// nodes leave one by one and come back in reverse order: each removal may only move the
+// keys of the node removed, and once all are back every key is where it started
+void do_check_anchor(shared_ptr<Hash> hash, int node_count, int removed)
+{
+    vector<string> strs = get_sequential_string_array(100000);
+    vector<tuple<string, int>> nodes;
+    for (int i = 0; i < node_count; i++) {
+        nodes.emplace_back(make_tuple("10." + to_string(i >> 16) + "." + to_string(i >> 8 & 255)
+                + "." + to_string(i & 255),
+            1));
+    }
+
+    auto route = [&] {
+        vector<string> results;
+        for (const auto &str : strs) {
+            results.emplace_back(hash->get(str));
+        }
+        return results;
+    };
+
+    hash->init(nodes);
+    vector<string> first = route();
+    vector<string> last = first;
+    vector<tuple<string, int>> gone;
+    size_t bad_moves = 0;
+    for (int i = 0; i < removed; i++) {
+        size_t victim = (i * 7919) % nodes.size();
+        gone.push_back(nodes[victim]);
+        nodes.erase(nodes.begin() + victim);
+        hash->init(nodes);
+        vector<string> results = route();
+        for (size_t k = 0; k < strs.size(); k++) {
+            bad_moves += results[k] != last[k] && last[k] != std::get<0>(gone.back());
+        }
+        last = std::move(results);
+    }
+    while (!gone.empty()) {
+        nodes.push_back(gone.back());
+        gone.pop_back();
+        hash->init(nodes);
+    }
+
+    vector<string> results = route();
+    size_t same = 0;
+    map<string, int> load;
+    for (size_t k = 0; k < strs.size(); k++) {
+        same += results[k] == first[k];
+        load[results[k]]++;
+    }
+    int max_load = 0;
+    for (const auto &it : load) {
+        max_load = std::max(max_load, it.second);
+    }
+    log_info("%s, node_count = %d, %lu keys moved off surviving nodes, same after re-adding is "
+             "%lu of %lu, max load %.02f of fair",
+        hash->name().data(), node_count, bad_moves, same, strs.size(),
+        max_load * (double)std::min<size_t>(node_count, strs.size()) / strs.size());
+}
+
+// every node goes at once and comes back in the same order: nothing is routed while
+// none is left, and then every key is back on its node
+void do_check_anchor_empty(shared_ptr<Hash> hash, int node_count)
+{
+    vector<string> strs = get_sequential_string_array(100000);
+    vector<tuple<string, int>> nodes = make_nodes(node_count, 1);
+
+    hash->init(nodes);
+    vector<string> first;
+    for (const auto &str : strs) {
+        first.emplace_back(hash->get(str));
+    }
+
+    size_t routed = 0;
+    size_t same = 0;
+    for (int round = 0; round < 3; round++) {
+        hash->init({});
+        for (const auto &str : strs) {
+            routed += !hash->get(str).empty();
+        }
+        hash->init(nodes);
+        for (size_t k = 0; k < strs.size(); k++) {
+            same += hash->get(strs[k]) == first[k];
+        }
+    }
+    log_info("%s, node_count = %d, %lu keys routed with no nodes, same after 3 empty round "
+             "trips is %lu of %lu",
+        hash->name().data(), node_count, routed, same, strs.size() * 3);
+}
+
+void check_anchor()
+{
+    do_check_anchor_empty(make_shared<AnchorHash<uint32_t>>(), 3);
+    do_check_anchor_empty(make_shared<AnchorHash<uint16_t>>(murmur_hash2, 200), 100);
+    do_check_anchor(make_shared<AnchorHash<uint16_t>>(), 100, 10);
+    do_check_anchor(make_shared<AnchorHash<uint16_t>>(murmur_hash2, 65536), 1000, 20);
+    do_check_anchor(make_shared<AnchorHash<uint32_t>>(murmur_hash2, 200), 100, 10);
+    do_check_anchor(make_shared<AnchorHash<uint32_t>>(), 70000, 5);
+}
+
+// radix_sort_vnodes must order by hash like a stable sort, whatever the thread count
+void check_radix_sort()
+{
+    std::mt19937 e;
+    for (size_t n : { 0, 1, 1000, 100000 }) {
+        vector<Vnode> vnodes;
+        for (size_t i = 0; i < n; i++) {
+            // every other hash drawn from a few, so that there are ties to keep in order
+            uint32_t hash = i % 2 ? e() % (n / 4 + 1) : e();
+            vnodes.emplace_back(hash, e(), i);
+        }
+        vector<Vnode> expected = vnodes;
+        std::stable_sort(expected.begin(), expected.end(),
+            [](const Vnode &a, const Vnode &b) { return a.hash() < b.hash(); });
+
+        for (unsigned nthreads : { 1, 2, 3, 8 }) {
+            vector<Vnode> sorted = vnodes;
+            radix_sort_vnodes(sorted, nthreads);
+            bool same = std::equal(sorted.begin(), sorted.end(), expected.begin(),
+                [](const Vnode &a, const Vnode &b) { return a.key == b.key && a.owner == b.owner; });
+            log_info("n = %lu, nthreads = %u, %s", n, nthreads,
+                same ? "same as stable_sort" : "DIFFERS from stable_sort");
+        }
+    }
+}
+
+// a ring built incrementally through a series of membership changes must route like one
+// built from scratch for the same nodes
+void check_incremental_init(shared_ptr<Hash> hash, shared_ptr<Hash> fresh)
+{
+    vector<string> strs = get_sequential_string_array(100000);
+    vector<tuple<string, int>> nodes = make_nodes(500, [](int i) { return 1 + i % 4; });
+
+    vector<vector<tuple<string, int>>> steps;
+    steps.push_back(nodes);
+    nodes.erase(nodes.begin() + 7);
+    steps.push_back(nodes);
+    nodes.insert(nodes.begin() + 7, make_tuple("127.0.0.8", 4));
+    steps.push_back(nodes);
+    std::get<1>(nodes[3]) = 9;
+    steps.push_back(nodes);
+    nodes.erase(nodes.begin() + 100, nodes.begin() + 110);
+    steps.push_back(nodes);
+    std::reverse(nodes.begin(), nodes.end());
+    steps.push_back(nodes);
+    nodes.emplace_back(make_tuple("127.0.1.1", 2));
+    steps.push_back(nodes);
+
+    vector<int> results(strs.size());
+    vector<int> expected(strs.size());
+    for (const auto &step : steps) {
+        hash->init(step);
+        hash->get_batch(strs.data(), strs.size(), results.data());
+        fresh->init({});
+        fresh->init(step);
+        fresh->get_batch(strs.data(), strs.size(), expected.data());
+
+        size_t same = 0;
+        for (size_t i = 0; i < strs.size(); i++) {
+            same += results[i] == expected[i];
+        }
+        log_info("%s, node_count = %lu, same is %lu of %lu", hash->name().data(), step.size(),
+            same, strs.size());
+    }
+}
+
+// one node leaves and comes back, over and over, against rebuilding from scratch
+void bench_flap(shared_ptr<Hash> hash, int node_count)
+{
+    string name = hash->name() + ":node_count=" + to_string(node_count);
+    vector<tuple<string, int>> nodes = make_nodes(node_count, 1);
+
+    const int full_rounds = 5;
+    double full_ms = 0;
+    for (int i = 0; i < full_rounds; i++) {
+        hash->init({});
+        struct timeval tv_start = tv_now();
+        hash->init(nodes);
+        full_ms += tv_sub_msec_double(tv_now(), tv_start);
+    }
+
+    const int flaps = 100;
+    struct timeval tv_start = tv_now();
+    for (int i = 0; i < flaps; i++) {
+        vector<tuple<string, int>> down = nodes;
+        down.erase(down.begin() + i % node_count);
+        hash->init(down);
+        hash->init(nodes);
+    }
+    double flap_ms = tv_sub_msec_double(tv_now(), tv_start);
+
+    log_info("%s full init %.02fms, flap init %.02fms", name.data(), full_ms / full_rounds,
+        flap_ms / flaps / 2);
+}
+
+// nthreads readers look keys up in batches while a health checker flips the weight of
+// one node after another between 5 and 1, calling init for every flip
+void bench_concurrent_init(shared_ptr<Hash> hash, int nthreads, int node_count, int ms)
+{
+    string name = hash->name() + ":node_count=" + to_string(node_count);
+    vector<string> strs = get_sequential_string_array(65536);
+    vector<tuple<string, int>> nodes = make_nodes(node_count, 5);
+    hash->init(nodes);
+
+    std::atomic<bool> stop { false };
+    std::atomic<long> lookups { 0 };
+    std::atomic<long> errors { 0 };
+    long inits = 0;
+
+    std::thread writer([&] {
+        for (int i = 0; !stop.load(std::memory_order_relaxed); i++) {
+            auto &weight = std::get<1>(nodes[i % node_count]);
+            weight = weight == 5 ? 1 : 5;
+            hash->init(nodes);
+            inits++;
+        }
+    });
+
+    vector<std::thread> readers;
+    for (int t = 0; t < nthreads; t++) {
+        readers.emplace_back([&] {
+            int out[Hash::kBatch];
+            long n = 0;
+            long bad = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (size_t i = 0; i < strs.size(); i += Hash::kBatch) {
+                    hash->get_batch(&strs[i], Hash::kBatch, out);
+                    for (int index : out) {
+                        bad += index < 0 || index >= node_count;
+                    }
+                }
+                n += strs.size();
+            }
+            lookups += n;
+            errors += bad;
+        });
+    }
+
+    struct timeval tv_start = tv_now();
+    usleep(ms * 1000);
+    stop = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    writer.join();
+    double ms_taken = tv_sub_msec_double(tv_now(), tv_start);
+
+    log_info("%s threads=%d, %.02fM lookups/s, %.0f inits/s, %ld bad lookups", name.data(),
+        nthreads, lookups / ms_taken / 1000, inits * 1000 / ms_taken, errors.load());
+}
+
+// threads fill one lazy YHash at once, each over all keys from its own offset; the table
+// they leave must be the one an eager build makes
+void check_yhash_fill(int nthreads, int node_count)
+{
+    vector<string> strs = get_sequential_string_array(1000000);
+    vector<tuple<string, int>> nodes = make_nodes(node_count, [](int i) { return 1 + i % 8; });
+    auto lazy = make_shared<YHash<>>();
+    auto eager = make_shared<YHash<>>(murmur_hash2, true);
+    lazy->init(nodes);
+    eager->init(nodes);
+
+    vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            size_t offset = strs.size() * t / nthreads;
+            for (size_t i = 0; i < strs.size(); i++) {
+                lazy->get_index(strs[(offset + i) % strs.size()]);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    size_t diff = 0;
+    for (const auto &str : strs) {
+        diff += lazy->get_index(str) != eager->get_index(str);
+    }
+    log_info("nthreads = %d, node_count = %d, %s", nthreads, node_count,
+        diff == 0 ? "same" : ("DIFFERENT " + to_string(diff)).data());
+}
+
+// init, then every one of the first count distinct keys timed on its own, each lookup
+// the first of its key; clock_gettime itself adds some 20ns to every sample
+void bench_cold_start(shared_ptr<Hash> hash, int node_count, int count)
+{
+    string name = hash->name() + ":node_count=" + to_string(node_count);
+    vector<string> strs = get_sequential_string_array(count);
+    vector<tuple<string, int>> nodes = make_nodes(node_count, 5);
+
+    struct timeval tv_start = tv_now();
+    hash->init(nodes);
+    double init_ms = tv_sub_msec_double(tv_now(), tv_start);
+
+    vector<double> ns(strs.size());
+    struct timespec ts_start, ts_end;
+    for (size_t i = 0; i < strs.size(); i++) {
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        hash->get_index(strs[i]);
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+        ns[i] = ts_sub_msec_double(ts_end, ts_start) * 1000000;
+    }
+    double total_ms = std::accumulate(ns.begin(), ns.end(), 0.0) / 1000000;
+    sort(ns.begin(), ns.end());
+
+    log_info("%s init %.02fms, first %d lookups %.02fms, p50 %.0fns, p99 %.0fns, max %.0fns",
+        name.data(), init_ms, count, total_ms, ns[ns.size() / 2], ns[ns.size() * 99 / 100],
+        ns.back());
 }
 
 void bench_strs(vector<shared_ptr<Hash>> hashs, vector<string> strs)
@@ -635,7 +2766,7 @@ void do_test_weight(shared_ptr<Hash> hash, vector<tuple<string, int>> nodes, vec
         [](int a, const tuple<string, int> &node) { return std::get<1>(node) + a; });
 
     for (const auto &str : strs) {
-        result_map[hash->get(str)]++;
+        result_map[string(hash->get(str))]++;
     }
 
     double total_diff = 0;
@@ -684,7 +2815,9 @@ int main(int argc, char **argv)
         test_weight(
             { make_shared<YHash<4096>>(), make_shared<YHash<16384>>(), make_shared<YHash<32768>>(),
                 make_shared<YHash<65536>>(), make_shared<YHash<655360>>(), make_shared<CHash>(),
-                make_shared<CHash2>(), make_shared<HRWHash>() },
+                make_shared<CHash2>(), make_shared<HRWHash>(), make_shared<FastHRWHash>(),
+                make_shared<SkeletonHRWHash>(), make_shared<JumpHash>(), make_shared<MaglevHash>(),
+                make_shared<MultiProbeHash>() },
             c);
     }
 
@@ -693,17 +2826,183 @@ int main(int argc, char **argv)
     check_consistency_1(make_shared<CHash>());
     check_consistency_1(make_shared<CHash2>());
     check_consistency_1(make_shared<HRWHash>());
+    check_consistency_1(make_shared<FastHRWHash>());
+    check_consistency_1(make_shared<SkeletonHRWHash>());
+    check_consistency_1(make_shared<AnchorHash<>>());
+    check_consistency_1(make_shared<JumpHash>());
+    check_consistency_1(make_shared<MaglevHash>());
+    check_consistency_1(make_shared<MultiProbeHash>());
     check_consistency_1(make_shared<YHash<>>());
     check_consistency_1(make_shared<YHash<16384>>());
 
     for (const auto &c : vector<int>{ 100000, 500000, 1000000 }) {
         bench({ make_shared<CHash>(), make_shared<CHash2>(), make_shared<HRWHash>(),
-                  make_shared<YHash<>>(), make_shared<YHash<16384>>() },
+                  make_shared<YHash<>>(), make_shared<YHash<16384>>(),
+                  make_shared<AnchorHash<uint16_t>>(), make_shared<AnchorHash<uint32_t>>(),
+                  make_shared<JumpHash>(), make_shared<MaglevHash>(), make_shared<MultiProbeHash>() },
             c);
     }
 
     bench_same_strs(
         { make_shared<CHash>(), make_shared<HRWHash>(), make_shared<YHash<>>() }, 1000000);
 
+    bench_batch({ make_shared<CHash>(), make_shared<HRWHash>(), make_shared<YHash<>>(),
+                    make_shared<AnchorHash<>>(), make_shared<FastHRWHash>(fast_hrw::Kernel::scalar),
+                    make_shared<FastHRWHash>(fast_hrw::Kernel::avx2), make_shared<FastHRWHash>(),
+                    make_shared<SkeletonHRWHash>() },
+        1000000, 64);
+
+    bench_lb({ make_shared<CHash>(), make_shared<AnchorHash<>>(), make_shared<FastHRWHash>(),
+                 make_shared<JumpHash>(), make_shared<MaglevHash>(5003), make_shared<MaglevHash>(),
+                 make_shared<MaglevHash>(655373), make_shared<MultiProbeHash>() },
+        1000000);
+
+    check_hrw_kernels(1000000);
+    // 65 and 513 reshape SkeletonHRWHash
+    for (int node_count : { 64, 65, 100, 500, 513 }) {
+        check_remove_node(make_shared<HRWHash>(), node_count);
+        check_remove_node(make_shared<SkeletonHRWHash>(), node_count);
+    }
+
+    check_radix_sort();
+    check_anchor();
+    check_incremental_init(make_shared<CHash>(), make_shared<CHash>());
+    check_incremental_init(make_shared<CHash2>(), make_shared<CHash2>());
+    for (int node_count : { 50, 500 }) {
+        bench_flap(make_shared<CHash>(), node_count);
+        bench_flap(make_shared<CHash2>(), node_count);
+    }
+
+    for (int nthreads : { 1, 2, 4, 8 }) {
+        bench_concurrent_init(make_shared<LockedHash<CHash>>(), nthreads, 500, 1000);
+        bench_concurrent_init(make_shared<RcuHash<CHash>>(), nthreads, 500, 1000);
+        bench_concurrent_init(make_shared<LockedHash<FastHRWHash>>(), nthreads, 500, 1000);
+        bench_concurrent_init(make_shared<RcuHash<FastHRWHash>>(), nthreads, 500, 1000);
+        bench_concurrent_init(make_shared<RcuHash<YHash<>>>(), nthreads, 500, 1000);
+    }
+
+    for (int nthreads : { 1, 4 }) {
+        check_yhash_fill(nthreads, 50);
+    }
+    for (int node_count : { 50, 500 }) {
+        bench_cold_start(make_shared<YHash<>>(), node_count, 100000);
+        for (unsigned nthreads : { 1, 4 }) {
+            bench_cold_start(
+                make_shared<YHash<>>(murmur_hash2, true, nthreads), node_count, 100000);
+        }
+        bench_cold_start(make_shared<CHash>(), node_count, 100000);
+    }
+
     return 0;
 }
+
+/*
+ * CHash lookups, 1M sequential keys, vnode ring as lower_bound over
+ * vector<tuple<uint32_t, int>> returning string (before) and as VnodeRing (after).
+ *
+    before
+    CHash:node_count=5 count=1000000 taken 86.08ms, 0.09us/op
+    CHash:node_count=50 count=1000000 taken 115.74ms, 0.12us/op
+    CHash:node_count=100 count=1000000 taken 129.67ms, 0.13us/op
+    CHash:node_count=250 count=1000000 taken 142.67ms, 0.14us/op
+    CHash:node_count=500 count=1000000 taken 165.87ms, 0.17us/op
+    after
+    CHash:node_count=5 count=1000000 taken 16.73ms, 0.02us/op, 59.76M lookups/s
+    CHash:node_count=50 count=1000000 taken 24.80ms, 0.02us/op, 40.32M lookups/s
+    CHash:node_count=100 count=1000000 taken 24.09ms, 0.02us/op, 41.52M lookups/s
+    CHash:node_count=250 count=1000000 taken 40.19ms, 0.04us/op, 24.88M lookups/s
+    CHash:node_count=500 count=1000000 taken 37.82ms, 0.04us/op, 26.44M lookups/s
+*/
+
+/*
+ * Weighted HRW, 1M sequential keys, 1 vCPU with AVX-512. HRWHash scores with std::log,
+ * FastHRWHash with the fast_hrw kernels, SkeletonHRWHash descends kFanout = 8 clusters
+ * per level, the 5000 and 50000 nodes by hand.
+ *
+    HRWHash:node_count=5 count=1000000 taken 97.57ms, 0.10us/op, 10.25M lookups/s
+    HRWHash:node_count=50 count=1000000 taken 870.57ms, 0.87us/op, 1.15M lookups/s
+    HRWHash:node_count=500 count=1000000 taken 9090.40ms, 9.09us/op, 0.11M lookups/s
+    FastHRWHash(scalar):node_count=5 count=1000000 taken 71.29ms, 0.07us/op, 14.03M lookups/s
+    FastHRWHash(scalar):node_count=50 count=1000000 taken 388.37ms, 0.39us/op, 2.57M lookups/s
+    FastHRWHash(scalar):node_count=500 count=1000000 taken 4769.17ms, 4.77us/op, 0.21M lookups/s
+    FastHRWHash(avx2):node_count=5 count=1000000 taken 93.50ms, 0.09us/op, 10.70M lookups/s
+    FastHRWHash(avx2):node_count=50 count=1000000 taken 230.04ms, 0.23us/op, 4.35M lookups/s
+    FastHRWHash(avx2):node_count=500 count=1000000 taken 1706.92ms, 1.71us/op, 0.59M lookups/s
+    FastHRWHash(avx512):node_count=5 count=1000000 taken 66.41ms, 0.07us/op, 15.06M lookups/s
+    FastHRWHash(avx512):node_count=50 count=1000000 taken 226.26ms, 0.23us/op, 4.42M lookups/s
+    FastHRWHash(avx512):node_count=500 count=1000000 taken 1486.18ms, 1.49us/op, 0.67M lookups/s
+    SkeletonHRWHash(avx512):node_count=5 count=1000000 taken 121.32ms, 0.12us/op, 8.24M lookups/s
+    SkeletonHRWHash(avx512):node_count=50 count=1000000 taken 198.35ms, 0.20us/op, 5.04M lookups/s
+    SkeletonHRWHash(avx512):node_count=500 count=1000000 taken 324.43ms, 0.32us/op, 3.08M lookups/s
+    SkeletonHRWHash(avx512):node_count=5000 count=1000000 taken 459.66ms, 0.46us/op, 2.18M lookups/s
+    SkeletonHRWHash(avx512):node_count=50000 count=1000000 taken 778.51ms, 0.78us/op, 1.28M lookups/s
+*/
+
+/*
+ * init while one node of node_count flaps, before: every init hashed all vnodes into
+ * strings and std::sort-ed them; after: radix_sort_vnodes for full builds, merge for the
+ * flap.
+ *
+    before
+    CHash:node_count=50 full init 0.79ms, flap init 0.99ms
+    CHash:node_count=500 full init 11.04ms, flap init 10.48ms
+    CHash2:node_count=500 full init 10.16ms, flap init 10.12ms
+    after
+    CHash:node_count=50 full init 0.60ms, flap init 0.20ms
+    CHash:node_count=500 full init 7.11ms, flap init 2.21ms
+    CHash2:node_count=500 full init 5.03ms, flap init 1.81ms
+*/
+
+/*
+ * bench_concurrent_init on a 1 vCPU sandbox: readers and the health checker only take
+ * turns, so lookups/s is the share of the CPU the readers got, and inits/s shows whether
+ * membership changes still get through.
+ *
+    LockedHash<CHash>:node_count=500 threads=1, 4.01M lookups/s, 60 inits/s
+    RcuHash<CHash>:node_count=500 threads=1, 8.72M lookups/s, 36 inits/s
+    LockedHash<CHash>:node_count=500 threads=8, 19.35M lookups/s, 2 inits/s
+    RcuHash<CHash>:node_count=500 threads=8, 14.91M lookups/s, 7 inits/s
+    LockedHash<FastHRWHash>:node_count=500 threads=8, 0.70M lookups/s, 13 inits/s
+    RcuHash<FastHRWHash>:node_count=500 threads=8, 0.70M lookups/s, 2445 inits/s
+*/
+
+/*
+ * bench_lb, 1M sequential keys, every node weight 5; check_consistency_1 as the share of
+ * keys kept when all weights double / when the last node goes (0.85 is ideal).
+ *
+    CHash:node_count=500 build 43.99ms, memory 6250.0KB, 65.2ns/op
+    AnchorHash<unsigned int>:node_count=500 build 0.14ms, memory 9.8KB, 15.8ns/op
+    FastHRWHash(avx512):node_count=500 build 0.03ms, memory 8.0KB, 1650.1ns/op
+    JumpHash:node_count=5 build 0.00ms, memory 0.2KB, 70.1ns/op
+    JumpHash:node_count=500 build 0.03ms, memory 10.0KB, 111.8ns/op
+    MaglevHash(5003):node_count=500 build 0.39ms, memory 19.5KB, 10.2ns/op
+    MaglevHash(65537):node_count=5 build 2.80ms, memory 256.0KB, 10.7ns/op
+    MaglevHash(65537):node_count=500 build 5.68ms, memory 256.0KB, 11.4ns/op
+    MaglevHash(655373):node_count=500 build 72.13ms, memory 2560.1KB, 21.5ns/op
+    MultiProbeHash:node_count=5 build 0.01ms, memory 0.4KB, 544.6ns/op
+    MultiProbeHash:node_count=500 build 0.36ms, memory 48.0KB, 1060.2ns/op
+
+    CHash            kept 0.64 / 0.59
+    JumpHash         kept 0.21 / 0.22
+    MaglevHash       kept 1.00 / 0.85
+    MultiProbeHash   kept 0.61 / 0.57
+*/
+
+/*
+ * bench_cold_start, every node weight 5: the first 100K distinct keys right after init,
+ * each timed alone. 1 vCPU sandbox, so the 4 thread build only takes turns with itself.
+ *
+    YHash<65536>:node_count=50 init 0.07ms, first 100000 lookups 21.38ms, p50 269ns, p99 449ns
+    YHash<65536>(eager, 1 threads):node_count=50 init 16.71ms, first 100000 lookups 7.06ms, p50 65ns, p99 110ns
+    CHash:node_count=50 init 3.51ms, first 100000 lookups 11.25ms, p50 109ns, p99 160ns
+    YHash<65536>:node_count=500 init 0.11ms, first 100000 lookups 87.36ms, p50 1463ns, p99 2535ns
+    YHash<65536>(eager, 1 threads):node_count=500 init 100.71ms, first 100000 lookups 6.94ms, p50 65ns, p99 174ns
+    YHash<65536>(eager, 4 threads):node_count=500 init 106.04ms, first 100000 lookups 7.15ms, p50 66ns, p99 190ns
+    CHash:node_count=500 init 42.76ms, first 100000 lookups 17.53ms, p50 153ns, p99 365ns
+
+ * YHash slots filled by HRWHash (before) and by the fast_hrw kernel (after), 1M keys,
+ * first pass over a fresh table:
+ *
+    before YHash<65536>:node_count=500 count=1000000 taken 629.16ms, 0.63us/op
+    after  YHash<65536>:node_count=500 count=1000000 taken 110.39ms, 0.11us/op
+*/
@@ -56,7 +56,7 @@ test(int n, int thread_num)
 {
     auto thread_func = [&] {
         T t;
-        elapsed e(get_filt_type_name<T>());
+        elapsed e(std::string(type_name<T>()));
 
         for (int i = 0; i < n; i++) {
             t.id_gen_impl();
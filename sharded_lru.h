@@ -0,0 +1,405 @@
+#ifndef SHARDED_LRU_H
+#define SHARDED_LRU_H
+
+// In-process cache derived from the simulator's LRUCacheImpl and its NodeTable: nodes
+// live in a slab and link to each other by 32-bit index, and an open-addressing index
+// maps keys to them. Slab and index are sized for max_entries up front and never grow,
+// freed nodes are reused, so put and evict never allocate beyond what copying K and V
+// does. Keys are spread over independent shards.
+//
+// Recency is CLOCK instead of an exact LRU list: a hit only sets the node's reference
+// bit. Inserts sweep the clock hand, evicting the first node whose bit is clear and
+// clearing the bits it passes.
+//
+// Writers take the shard's lock and bump its sequence count before and after they
+// change anything. Hits take no lock when K and V are trivially copyable: keys and
+// values are then kept as relaxed atomic words, a reader looks the key up and copies the
+// value, then checks that the sequence count is still the even one it started from, and
+// tries again if a writer got in between. Since nothing is ever freed or moved, a reader
+// racing a writer reads stale words, never freed ones. Other K and V, std::string say,
+// are read under the shard lock held shared, so their hits only contend on the lock word.
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string.h>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+template <typename K, typename V, typename Hash = std::hash<K>> class ShardedLRU {
+public:
+    // capacity is the total charge of the values, by default 1 per value; max_entries
+    // bounds the number of values and sizes the tables, 0 makes it capacity
+    explicit ShardedLRU(size_t capacity, size_t nshards = 16, size_t max_entries = 0)
+    {
+        size_t n = 1;
+        while (n < nshards) {
+            n *= 2;
+        }
+        if (max_entries == 0) {
+            max_entries = capacity;
+        }
+        shards_.reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            shards_.emplace_back(new Shard((capacity + n - 1) / n, (max_entries + n - 1) / n));
+        }
+        mask_ = n - 1;
+    }
+
+    bool get(const K &key, V *value) const
+    {
+        uint64_t h = hash_key(key);
+        const Shard &shard = shard_of(h);
+
+        if constexpr (kLockFreeReads) {
+            for (int attempt = 0; attempt < kReadAttempts; attempt++) {
+                uint64_t seq = shard.seq.load(std::memory_order_acquire);
+                if (seq & 1) {
+                    continue;
+                }
+                V v;
+                uint32_t n = shard.find(key, h);
+                if (n != kNil) {
+                    v = shard.nodes[n].value.load();
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (shard.seq.load(std::memory_order_relaxed) != seq) {
+                    continue;
+                }
+                if (n == kNil) {
+                    return false;
+                }
+                shard.touch(n);
+                *value = v;
+                return true;
+            }
+        }
+
+        // writers kept getting in the way, or K and V cannot be copied racily
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        uint32_t n = shard.find(key, h);
+        if (n == kNil) {
+            return false;
+        }
+        shard.touch(n);
+        *value = shard.nodes[n].value.load();
+        return true;
+    }
+
+    void put(const K &key, V value, size_t charge = 1)
+    {
+        uint64_t h = hash_key(key);
+        Shard &shard = shard_of(h);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        typename Shard::WriteSection section(shard);
+
+        uint32_t n = shard.find(key, h);
+        if (n != kNil) {
+            Node &node = shard.nodes[n];
+            shard.used += charge - node.charge;
+            node.value.store(std::move(value));
+            node.charge = charge;
+            node.referenced.store(true, std::memory_order_relaxed);
+        } else {
+            while (shard.count == shard.nodes.size()) {
+                shard.evict_one();
+            }
+            n = shard.alloc_node();
+            Node &node = shard.nodes[n];
+            node.key.store(key);
+            node.value.store(std::move(value));
+            node.charge = charge;
+            node.referenced.store(false, std::memory_order_relaxed);
+            shard.insert_before_hand(n);
+            shard.place(n, h);
+            shard.used += charge;
+        }
+
+        while (shard.used > shard.capacity && shard.hand != kNil) {
+            shard.evict_one();
+        }
+    }
+
+    bool erase(const K &key)
+    {
+        uint64_t h = hash_key(key);
+        Shard &shard = shard_of(h);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        uint32_t n = shard.find(key, h);
+        if (n == kNil) {
+            return false;
+        }
+        typename Shard::WriteSection section(shard);
+        shard.remove(n);
+        return true;
+    }
+
+    size_t size() const
+    {
+        size_t n = 0;
+        for (const auto &shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            n += shard->count;
+        }
+        return n;
+    }
+
+    size_t used() const
+    {
+        size_t n = 0;
+        for (const auto &shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            n += shard->used;
+        }
+        return n;
+    }
+
+private:
+    static constexpr uint32_t kNil = UINT32_MAX;
+    static constexpr bool kLockFreeReads
+        = std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value;
+    static constexpr int kReadAttempts = 8;
+
+    // a trivially copyable T lives in relaxed atomic words, so the racing copies a
+    // lock-free reader makes are well defined; any other T is only touched under the lock
+    template <typename T, bool = std::is_trivially_copyable<T>::value> struct Cell {
+        T load() const { return value; }
+        void store(T v) { value = std::move(v); }
+        bool equals(const T &v) const { return value == v; }
+
+        T value {};
+    };
+
+    template <typename T> struct Cell<T, true> {
+        static constexpr size_t kWords = (sizeof(T) + 7) / 8;
+
+        T load() const
+        {
+            uint64_t w[kWords];
+            for (size_t i = 0; i < kWords; i++) {
+                w[i] = words[i].load(std::memory_order_relaxed);
+            }
+            T v;
+            memcpy(&v, w, sizeof(T));
+            return v;
+        }
+
+        void store(const T &v)
+        {
+            uint64_t w[kWords] = {};
+            memcpy(w, &v, sizeof(T));
+            for (size_t i = 0; i < kWords; i++) {
+                words[i].store(w[i], std::memory_order_relaxed);
+            }
+        }
+
+        bool equals(const T &v) const { return load() == v; }
+
+        std::atomic<uint64_t> words[kWords] = {};
+    };
+
+    struct Node {
+        Cell<K> key;
+        Cell<V> value;
+        size_t charge = 0;
+        uint32_t prev = kNil;
+        uint32_t next = kNil;
+        mutable std::atomic<bool> referenced { false };
+    };
+
+    struct Shard {
+        Shard(size_t capacity, size_t max_entries)
+            : nodes(std::max<size_t>(max_entries, 1))
+            , slots(slot_count(nodes.size()))
+            , slot_mask(slots.size() - 1)
+            , capacity(capacity)
+        {
+            for (auto &slot : slots) {
+                slot.store(kNil, std::memory_order_relaxed);
+            }
+            for (uint32_t n = 0; n < nodes.size(); n++) {
+                nodes[n].next = n + 1 < nodes.size() ? n + 1 : kNil;
+            }
+            free = 0;
+        }
+
+        // at most 3/4 full, like NodeTable before it rehashes
+        static size_t slot_count(size_t nodes)
+        {
+            size_t n = 16;
+            while (nodes * 4 > n * 3) {
+                n *= 2;
+            }
+            return n;
+        }
+
+        // odd while a writer is at work, see the top of the file
+        struct WriteSection {
+            explicit WriteSection(Shard &shard)
+                : shard(shard)
+            {
+                shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+            }
+
+            ~WriteSection()
+            {
+                shard.seq.store(
+                    shard.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            }
+
+            Shard &shard;
+        };
+
+        // a slot is the node index in the low half, the low 32 bits of the hash above
+        static uint32_t slot_node(uint64_t slot) { return (uint32_t)slot; }
+        static uint32_t slot_tag(uint64_t slot) { return slot >> 32; }
+
+        // a reader racing a backward shift may not meet an empty slot, so give up after one
+        // lap; the sequence check then sends it round again
+        uint32_t find(const K &key, uint64_t h) const
+        {
+            size_t i = h & slot_mask;
+            for (size_t probes = 0; probes <= slot_mask; probes++, i = (i + 1) & slot_mask) {
+                uint64_t slot = slots[i].load(std::memory_order_relaxed);
+                uint32_t n = slot_node(slot);
+                if (n == kNil) {
+                    return kNil;
+                }
+                if (slot_tag(slot) == (uint32_t)h && nodes[n].key.equals(key)) {
+                    return n;
+                }
+            }
+            return kNil;
+        }
+
+        void touch(uint32_t n) const
+        {
+            if (!nodes[n].referenced.load(std::memory_order_relaxed)) {
+                nodes[n].referenced.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        void place(uint32_t n, uint64_t h)
+        {
+            size_t i = h & slot_mask;
+            while (slot_node(slots[i].load(std::memory_order_relaxed)) != kNil) {
+                i = (i + 1) & slot_mask;
+            }
+            slots[i].store((uint64_t)(uint32_t)h << 32 | n, std::memory_order_relaxed);
+            count++;
+        }
+
+        // backward shift deletion keeps probe chains intact without tombstones
+        void unplace(uint32_t n)
+        {
+            size_t i = hash_key(nodes[n].key.load()) & slot_mask;
+            while (slot_node(slots[i].load(std::memory_order_relaxed)) != n) {
+                i = (i + 1) & slot_mask;
+            }
+            for (size_t j = (i + 1) & slot_mask;; j = (j + 1) & slot_mask) {
+                uint64_t slot = slots[j].load(std::memory_order_relaxed);
+                if (slot_node(slot) == kNil) {
+                    break;
+                }
+                size_t home = slot_tag(slot) & slot_mask;
+                if (((j - home) & slot_mask) >= ((j - i) & slot_mask)) {
+                    slots[i].store(slot, std::memory_order_relaxed);
+                    i = j;
+                }
+            }
+            slots[i].store(kNil, std::memory_order_relaxed);
+            count--;
+        }
+
+        uint32_t alloc_node()
+        {
+            uint32_t n = free;
+            free = nodes[n].next;
+            return n;
+        }
+
+        // the newest node sits just behind the hand, the last one it will reach
+        void insert_before_hand(uint32_t n)
+        {
+            if (hand == kNil) {
+                nodes[n].prev = n;
+                nodes[n].next = n;
+                hand = n;
+                return;
+            }
+            uint32_t prev = nodes[hand].prev;
+            nodes[n].prev = prev;
+            nodes[n].next = hand;
+            nodes[prev].next = n;
+            nodes[hand].prev = n;
+        }
+
+        void evict_one()
+        {
+            while (nodes[hand].referenced.load(std::memory_order_relaxed)) {
+                nodes[hand].referenced.store(false, std::memory_order_relaxed);
+                hand = nodes[hand].next;
+            }
+            remove(hand);
+        }
+
+        void remove(uint32_t n)
+        {
+            Node &node = nodes[n];
+            if (node.next == n) {
+                hand = kNil;
+            } else {
+                nodes[node.prev].next = node.next;
+                nodes[node.next].prev = node.prev;
+                if (hand == n) {
+                    hand = node.next;
+                }
+            }
+            unplace(n);
+            used -= node.charge;
+
+            node.key.store(K());
+            node.value.store(V());
+            node.next = free;
+            free = n;
+        }
+
+        mutable std::shared_mutex mutex;
+        std::atomic<uint64_t> seq { 0 };
+        std::vector<Node> nodes;
+        std::vector<std::atomic<uint64_t>> slots;
+        size_t slot_mask;
+        uint32_t hand = kNil;
+        uint32_t free = kNil;
+        size_t count = 0;
+        size_t capacity;
+        size_t used = 0;
+    };
+
+    static uint64_t hash_key(const K &key)
+    {
+        // std::hash of an integer is the integer itself, so mix it; the top bits pick the
+        // shard, the low bits the slot
+        uint64_t h = Hash()(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    Shard &shard_of(uint64_t h) const { return *shards_[(h >> 48) & mask_]; }
+
+private:
+    std::vector<std::unique_ptr<Shard>> shards_;
+    size_t mask_;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include "sharded_lru.h"
+#include "util.h"
+#include <cmath>
+#include <list>
+#include <mutex>
+#include <random>
+
+using std::string;
+using std::vector;
+
+// the baseline: an exact LRU list behind one mutex, every hit relinks under it
+template <typename K, typename V> class MutexLRU {
+public:
+    explicit MutexLRU(size_t capacity)
+        : capacity_(capacity)
+    {
+    }
+
+    bool get(const K &key, V *value)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            return false;
+        }
+        list_.splice(list_.begin(), list_, it->second);
+        *value = it->second->second;
+        return true;
+    }
+
+    void put(const K &key, V value)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            it->second->second = std::move(value);
+            list_.splice(list_.begin(), list_, it->second);
+            return;
+        }
+
+        list_.emplace_front(key, std::move(value));
+        index_.emplace(key, list_.begin());
+        if (index_.size() > capacity_) {
+            index_.erase(list_.back().first);
+            list_.pop_back();
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::list<std::pair<K, V>> list_;
+    std::unordered_map<K, typename std::list<std::pair<K, V>>::iterator> index_;
+    size_t capacity_;
+};
+
+static const long kKeys = 1 << 20;
+static const size_t kCapacity = 1 << 17;
+static const int kOps = 4000000;
+
+// skewed keys, the same for every cache and thread count
+static vector<uint64_t> make_keys()
+{
+    std::default_random_engine e;
+    std::uniform_real_distribution<double> u(0, 1);
+    vector<uint64_t> keys(kOps);
+    for (auto &key : keys) {
+        key = (uint64_t)std::pow(kKeys, u(e)) - 1;
+    }
+    return keys;
+}
+
+// kOps get-or-put requests split over nthreads, each value is its key, returns Mops/s
+template <typename Cache, typename K> static double run(Cache &cache, const vector<K> &keys,
+    int nthreads, std::atomic<long> *hits)
+{
+    vector<std::thread> threads;
+    struct timeval tv_start = tv_now();
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            long h = 0;
+            for (size_t i = t; i < keys.size(); i += nthreads) {
+                K value;
+                if (cache.get(keys[i], &value)) {
+                    if (value != keys[i]) {
+                        log_fatal("request %zu came back with another key's value", i);
+                    }
+                    h++;
+                } else {
+                    cache.put(keys[i], keys[i]);
+                }
+            }
+            *hits += h;
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return keys.size() / tv_sub_msec_double(tv_now(), tv_start) / 1000;
+}
+
+template <typename Cache, typename K>
+static void bench(const char *name, const vector<K> &keys, int nthreads)
+{
+    Cache cache(kCapacity);
+    std::atomic<long> hits { 0 };
+    double mops = run(cache, keys, nthreads, &hits);
+    printf("%-34s threads = %2d, %6.2f Mops/s, hit ratio %.02f%%\n", name, nthreads, mops,
+        hits * 100.0 / keys.size());
+}
+
+int
+main(void)
+{
+    vector<uint64_t> keys = make_keys();
+    // object names as the proxy sees them, not trivially copyable, so hits take the shard
+    // lock shared
+    vector<string> names;
+    names.reserve(keys.size());
+    for (uint64_t key : keys) {
+        names.push_back("/bucket/object-" + std::to_string(key));
+    }
+
+    for (int nthreads : { 1, 2, 4, 8, 16, 32, 64 }) {
+        bench<MutexLRU<uint64_t, uint64_t>>("MutexLRU<uint64_t, uint64_t>", keys, nthreads);
+        bench<ShardedLRU<uint64_t, uint64_t>>("ShardedLRU<uint64_t, uint64_t>", keys, nthreads);
+        bench<MutexLRU<string, string>>("MutexLRU<string, string>", names, nthreads);
+        bench<ShardedLRU<string, string>>("ShardedLRU<string, string>", names, nthreads);
+    }
+
+    return 0;
+}
+
+/*
+ * 1 vCPU sandbox, so threads only interleave and this shows per-request cost plus lock
+ * handoff, not parallel scaling. ShardedLRU<uint64_t, uint64_t> hits write nothing shared
+ * but the reference bit, which only the first hit after a sweep sets; string hits also
+ * take the shard lock shared.
+ *
+    $ ./sharded_lru_bench
+    MutexLRU<uint64_t, uint64_t>       threads =  1,   4.65 Mops/s, hit ratio 78.34%
+    ShardedLRU<uint64_t, uint64_t>     threads =  1,  16.69 Mops/s, hit ratio 78.91%
+    MutexLRU<string, string>           threads =  1,   1.57 Mops/s, hit ratio 78.34%
+    ShardedLRU<string, string>         threads =  1,   3.06 Mops/s, hit ratio 78.90%
+    MutexLRU<uint64_t, uint64_t>       threads =  2,   3.77 Mops/s, hit ratio 78.34%
+    ShardedLRU<uint64_t, uint64_t>     threads =  2,  14.60 Mops/s, hit ratio 78.90%
+    MutexLRU<string, string>           threads =  2,   1.45 Mops/s, hit ratio 78.34%
+    ShardedLRU<string, string>         threads =  2,   2.71 Mops/s, hit ratio 78.91%
+    MutexLRU<uint64_t, uint64_t>       threads =  4,   4.20 Mops/s, hit ratio 78.34%
+    ShardedLRU<uint64_t, uint64_t>     threads =  4,  13.34 Mops/s, hit ratio 78.91%
+    MutexLRU<string, string>           threads =  4,   1.24 Mops/s, hit ratio 78.34%
+    ShardedLRU<string, string>         threads =  4,   2.34 Mops/s, hit ratio 78.91%
+    MutexLRU<uint64_t, uint64_t>       threads =  8,   3.56 Mops/s, hit ratio 78.34%
+    ShardedLRU<uint64_t, uint64_t>     threads =  8,   6.51 Mops/s, hit ratio 78.91%
+    MutexLRU<string, string>           threads =  8,   1.11 Mops/s, hit ratio 78.35%
+    ShardedLRU<string, string>         threads =  8,   2.13 Mops/s, hit ratio 78.91%
+    MutexLRU<uint64_t, uint64_t>       threads = 16,   3.27 Mops/s, hit ratio 78.35%
+    ShardedLRU<uint64_t, uint64_t>     threads = 16,   6.16 Mops/s, hit ratio 78.93%
+    MutexLRU<string, string>           threads = 16,   1.18 Mops/s, hit ratio 78.34%
+    ShardedLRU<string, string>         threads = 16,   2.09 Mops/s, hit ratio 78.90%
+    MutexLRU<uint64_t, uint64_t>       threads = 32,   3.12 Mops/s, hit ratio 78.33%
+    ShardedLRU<uint64_t, uint64_t>     threads = 32,   5.81 Mops/s, hit ratio 78.90%
+    MutexLRU<string, string>           threads = 32,   0.92 Mops/s, hit ratio 78.33%
+    ShardedLRU<string, string>         threads = 32,   1.88 Mops/s, hit ratio 78.90%
+    MutexLRU<uint64_t, uint64_t>       threads = 64,   2.55 Mops/s, hit ratio 78.34%
+    ShardedLRU<uint64_t, uint64_t>     threads = 64,   7.02 Mops/s, hit ratio 78.90%
+    MutexLRU<string, string>           threads = 64,   1.05 Mops/s, hit ratio 78.34%
+    ShardedLRU<string, string>         threads = 64,   2.02 Mops/s, hit ratio 78.90%
+*/
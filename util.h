@@ -156,6 +156,62 @@ get_size_str(size_t sz, char *buf, size_t cap)
     snprintf(buf, cap, "%.1f%s", n, unit);
 }
 
+// MurmurHash64A
+static uint64_t
+murmur_hash64a(const void *key, size_t len, uint64_t seed)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    uint64_t h = seed ^ (len * m);
+
+    const unsigned char *data = (const unsigned char *)key;
+    const unsigned char *end = data + (len & ~(size_t)7);
+
+    while (data != end) {
+        uint64_t k;
+        memcpy(&k, data, sizeof(k));
+        data += sizeof(k);
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (len & 7) {
+    case 7:
+        h ^= (uint64_t)data[6] << 48;
+        /* fall through */
+    case 6:
+        h ^= (uint64_t)data[5] << 40;
+        /* fall through */
+    case 5:
+        h ^= (uint64_t)data[4] << 32;
+        /* fall through */
+    case 4:
+        h ^= (uint64_t)data[3] << 24;
+        /* fall through */
+    case 3:
+        h ^= (uint64_t)data[2] << 16;
+        /* fall through */
+    case 2:
+        h ^= (uint64_t)data[1] << 8;
+        /* fall through */
+    case 1:
+        h ^= (uint64_t)data[0];
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
 typedef struct key_value_s key_value_t;
 
 struct key_value_s {
@@ -263,6 +319,24 @@ cmd_set_int(void *p, const char *value, char **errstr)
     return 0;
 }
 
+static int
+cmd_set_double(void *p, const char *value, char **errstr)
+{
+    assert(value);
+
+    char *endp = NULL;
+    double d = strtod(value, &endp);
+
+    if (endp == value || *endp != '\0') {
+        set_errstr(errstr, "invalid number");
+        return -1;
+    }
+
+    *(double *)p = d;
+
+    return 0;
+}
+
 static int
 cmd_set_str(void *p, const char *value, char **errstr)
 {
@@ -1068,12 +1142,14 @@ log_raw(int logfd, char *buf, size_t cap, int level, const char *file, int line,
 #include <map>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <typeinfo>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <tuple>
+#include <type_traits>
 #include <algorithm>
 
 class elapsed {
@@ -1091,20 +1167,24 @@ private:
 };
 
 template <typename T>
-std::string
-get_filt_type_name()
+constexpr std::string_view
+pretty_type_name()
 {
-    std::string name = typeid(T).name();
-
-    std::string command = "c++filt " + name;
-    size_t n = name.length() * 3 + 10;
-    char *buf = (char *)malloc(n);
-    if (read_command_output(command.c_str(), buf, n) == 0) {
-        name = buf;
-        name.erase(name.find('\n'));
-    }
-    free(buf);
+    // gcc: "... pretty_type_name() [with T = X; std::string_view = ...]"
+    // clang: "... pretty_type_name() [T = X]"
+    std::string_view name = __PRETTY_FUNCTION__;
+    size_t start = name.find("T = ") + 4;
+    return name.substr(start, name.find_first_of(";]", start) - start);
+}
 
+// Readable name of type T, cut out of __PRETTY_FUNCTION__ at compile time.
+// References and cv-qualifiers are dropped, so decltype(*this) works.
+template <typename T>
+constexpr std::string_view
+type_name()
+{
+    using U = std::remove_cv_t<std::remove_reference_t<T>>;
+    constexpr std::string_view name = pretty_type_name<U>();
     return name;
 }
 